@@ -0,0 +1,105 @@
+#include "main.h"
+#include <avr/io.h>
+#include <avr/eeprom.h>
+
+// EEPROM write queue
+// writing a byte takes about 3.4 ms and eeprom_update_block waits for every byte before starting the next
+// so saving a record used to keep usbPoll from running for longer than V-USB allows
+// instead, writes are queued here and eeq_poll starts one byte at a time whenever the EEPROM is idle
+// eeq_poll is called from usbPollWrapper, so the EEPROM keeps writing in the background while USB is serviced
+// bytes are written in the order they were queued, so anything that relies on the order (like writing a header last) still works
+// reads must go through eeq_read_block so they see the queued bytes that are not written yet
+
+#define EEQ_SIZE 8 // one keymap record, a longer queue only moves the wait, the EEPROM is no faster
+
+static uint16_t eeq_addr[EEQ_SIZE];
+static uint8_t eeq_val[EEQ_SIZE];
+static uint8_t eeq_head = 0; // next free entry
+static uint8_t eeq_cnt = 0; // entries waiting to be written
+static char eeq_held = 0; // nothing is written while this is set, see eeq_hold
+
+#define eeq_idx(i) (((i) >= EEQ_SIZE) ? ((i) - EEQ_SIZE) : (i))
+
+// starts writing the oldest queued byte if the EEPROM is not busy, never waits
+void eeq_poll()
+{
+	if (eeq_cnt == 0 || eeq_held || bit_is_set(EECR, EEPE)) {
+		return;
+	}
+	uint8_t t = eeq_idx(eeq_head + EEQ_SIZE - eeq_cnt);
+	eeprom_update_byte((uint8_t*)eeq_addr[t], eeq_val[t]); // returns once the write is started
+	eeq_cnt--;
+}
+
+// services USB while waiting for the queue to drain
+static void eeq_wait()
+{
+	#ifdef ENABLE_FLASH_KEYMAP
+	if (eeq_held) {
+		flashmap_abort(); // a held queue only drains once the host sends the rest of the flash page, which it may never do
+	}
+	#endif
+	usbPollWrapper(); // also calls eeq_poll
+}
+
+// queues a byte to be written, waits (servicing USB) only if the queue is full
+void eeq_write_byte(uint8_t* dst, uint8_t val)
+{
+	uint16_t addr = (uint16_t)dst;
+	// if the byte was the last one queued, the new value replaces it
+	// an older entry for it is left alone and the byte is queued again, so the order of the writes is kept
+	if (eeq_cnt != 0)
+	{
+		uint8_t j = eeq_idx(eeq_head + EEQ_SIZE - 1);
+		if (eeq_addr[j] == addr) {
+			eeq_val[j] = val;
+			return;
+		}
+	}
+	while (eeq_cnt == EEQ_SIZE) {
+		eeq_wait();
+	}
+	eeq_addr[eeq_head] = addr;
+	eeq_val[eeq_head] = val;
+	eeq_head = eeq_idx(eeq_head + 1);
+	eeq_cnt++;
+}
+
+void eeq_write_block(const void* src, void* dst, uint8_t n)
+{
+	for (uint8_t i = 0; i < n; i++) {
+		eeq_write_byte((uint8_t*)dst + i, ((const uint8_t*)src)[i]);
+	}
+}
+
+// reads from EEPROM as if every queued byte was already written
+// a byte can be queued more than once, the newest entry comes last so it wins
+void eeq_read_block(void* dst, const void* src, uint8_t n)
+{
+	eeprom_read_block(dst, src, n);
+	uint16_t addr = (uint16_t)src;
+	for (uint8_t i = 0; i < eeq_cnt; i++)
+	{
+		uint8_t j = eeq_idx(eeq_head + EEQ_SIZE - eeq_cnt + i);
+		uint16_t k = eeq_addr[j] - addr;
+		if (k < n) {
+			((uint8_t*)dst)[k] = eeq_val[j];
+		}
+	}
+}
+
+// waits until everything queued is written, for when the data must be in EEPROM before going on
+void eeq_flush()
+{
+	while (eeq_cnt != 0) {
+		eeq_wait();
+	}
+	eeprom_busy_wait();
+}
+
+// stops writing queued bytes until it is called again with 0, bytes can still be queued and read meanwhile
+// the flash keymap needs this while it fills the SPM page buffer, which an EEPROM write would clear
+void eeq_hold(char on)
+{
+	eeq_held = on;
+}
@@ -0,0 +1,229 @@
+#include "main.h"
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/boot.h>
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+#include <util/crc16.h>
+
+// a large keymap kept in flash, in the space the firmware does not use
+// the EEPROM only holds KEYMAP_MAX_RECORDS learned codes, this holds FLASHMAP_MAX_RECORDS
+// the records are the same (IR code, keycode) pairs as the EEPROM keymap, but sorted by IR code
+// so they are looked up with the same binary search as the built-in tables
+// the header (see keymap_hdr_t) sits at the very end of the region, in the last page
+// so a new keymap is written page by page from the start and the header page goes last
+// the header page is erased first, so a keymap that was only partly written is never used
+//
+// the region is placed by the linker, see the .usrmap section in the makefile, it must be page aligned
+// the flash is written with SPM, which needs the SELFPRGEN fuse (see burnfuses)
+// the records are put straight into the SPM page buffer as they arrive, there is no copy of the page in RAM
+// the CPU stops while a page is erased or written (about 4.5 ms each), USB is serviced between the two
+
+#ifdef ENABLE_FLASH_KEYMAP
+
+#define FLASHMAP_SIZE			2048
+#define FLASHMAP_HDR_OFFSET		(FLASHMAP_SIZE - 8) // the last 8 bytes, header plus padding
+#define FLASHMAP_MAX_RECORDS	(FLASHMAP_HDR_OFFSET / 8) // keymap_rec_t is 8 bytes
+
+#if FLASHMAP_MAX_RECORDS > 255
+#error "flash keymap too big for the record count"
+#endif
+#if (FLASHMAP_SIZE % SPM_PAGESIZE) != 0 || (SPM_PAGESIZE % 8) != 0
+#error "flash keymap must be whole pages of whole records"
+#endif
+
+// what flashmap_spm does
+#define FLASHMAP_FILL	0
+#define FLASHMAP_ERASE	1
+#define FLASHMAP_WRITE	2
+
+// erased flash, so a freshly burned unit has no flash keymap
+const uint8_t flash_keymap[FLASHMAP_SIZE] __attribute__((section(".usrmap"), used)) = { [0 ... FLASHMAP_SIZE - 1] = 0xFF };
+
+static uint8_t flashmap_cnt = 0; // number of valid records
+
+// state while a new keymap is being written, the records go straight into the SPM page buffer
+static char flashmap_writing = 0;
+static uint8_t flashmap_wr_cnt; // records written so far
+static uint16_t flashmap_wr_crc;
+static uint32_t flashmap_wr_last; // IR code of the last record written, they must go up
+
+static uint16_t flashmap_crc(uint8_t cnt)
+{
+	uint16_t crc = 0xFFFF;
+	for (uint16_t i = 0; i < cnt * sizeof(keymap_rec_t); i++) {
+		crc = _crc16_update(crc, pgm_read_byte(&flash_keymap[i]));
+	}
+	return crc;
+}
+
+// checks the flash keymap, must be called once at start-up
+void flashmap_init()
+{
+	keymap_hdr_t hdr;
+	memcpy_P((void*)&hdr, &flash_keymap[FLASHMAP_HDR_OFFSET], sizeof(keymap_hdr_t));
+	flashmap_cnt = 0;
+	if (hdr.magic == KEYMAP_MAGIC && hdr.version == KEYMAP_VERSION && hdr.count <= FLASHMAP_MAX_RECORDS && flashmap_crc(hdr.count) == hdr.crc) {
+		flashmap_cnt = hdr.count;
+	}
+}
+
+uint8_t flashmap_count()
+{
+	return flashmap_cnt;
+}
+
+uint32_t flashmap_ir_to_kb(uint32_t ir)
+{
+	return pair_tbl_search((const uint32_t*)flash_keymap, flashmap_cnt, ir);
+}
+
+#ifdef ENABLE_ADDR_FILTER
+void flashmap_addr_filter_add()
+{
+	for (uint8_t i = 0; i < flashmap_cnt; i++) {
+		addr_filter_add(pgm_read_word(&flash_keymap[i * sizeof(keymap_rec_t)]), 0xFFFF);
+	}
+}
+#endif
+
+// the SPM instruction must follow its write to SPMCSR within 4 cycles, so interrupts are off around each one
+// erasing or writing a page stops the CPU for about 4.5 ms (the ATtiny85 cannot read flash meanwhile)
+// so USB is not serviced then, control transfers that arrive meanwhile fail and the host has to try again (keymapc waits and retries)
+// an EEPROM write clears the SPM page buffer, so eeq is held from the first word of a page until the page is written
+static void flashmap_spm(uint8_t op, uint16_t offset, uint16_t w)
+{
+	uint16_t addr = (uint16_t)flash_keymap + offset;
+	uint8_t sreg = SREG;
+	cli();
+	if (op == FLASHMAP_FILL) {
+		boot_page_fill(addr, w);
+	}
+	else
+	{
+		eeprom_busy_wait();
+		if (op == FLASHMAP_ERASE) {
+			boot_page_erase(addr);
+		}
+		else {
+			boot_page_write(addr);
+		}
+		boot_spm_busy_wait();
+	}
+	SREG = sreg;
+}
+
+// puts bytes into the SPM page buffer, they are written to the page at offset (a multiple of SPM_PAGESIZE) by FLASHMAP_WRITE
+// offset and n must be even, data 0 fills with 0xFF
+static void flashmap_fill(uint16_t offset, const uint8_t* data, uint8_t n)
+{
+	if ((offset % SPM_PAGESIZE) == 0) {
+		eeq_hold(1);
+		eeprom_busy_wait(); // a write that was already going would clear the buffer too
+	}
+	for (uint8_t i = 0; i < n; i += 2) {
+		flashmap_spm(FLASHMAP_FILL, offset + i, data ? (data[i] | (data[i + 1] << 8)) : 0xFFFF);
+	}
+}
+
+// writes the page that was filled and lets eeq go on
+static void flashmap_write(uint16_t page)
+{
+	flashmap_spm(FLASHMAP_WRITE, page, 0);
+	eeq_hold(0);
+}
+
+// starts writing a new keymap, the old one stops working right away
+void flashmap_begin()
+{
+	flashmap_abort(); // an upload that was never committed
+	flashmap_cnt = 0;
+	flashmap_spm(FLASHMAP_ERASE, FLASHMAP_SIZE - SPM_PAGESIZE, 0); // remove the header, the page stays erased until the commit
+	flashmap_writing = 1;
+	flashmap_wr_cnt = 0;
+	flashmap_wr_crc = 0xFFFF;
+	flashmap_wr_last = 0;
+}
+
+// gives up the upload, the page being filled is dropped and the flash keymap stays invalid
+// called by eeq when it cannot wait for the page to be finished
+void flashmap_abort()
+{
+	if (flashmap_writing == 0) {
+		return;
+	}
+	SPMCSR = _BV(CTPB); // empty the page buffer
+	flashmap_writing = 0;
+	eeq_hold(0);
+}
+
+// adds a record, they must come in order of IR code, returns a VCFG status
+// the first record of a page erases it and the last one writes it, so each takes about 4.5 ms, never both
+uint8_t flashmap_add(keymap_rec_t* rec)
+{
+	if (flashmap_writing == 0) {
+		return VCFG_ERR_CMD;
+	}
+	if (flashmap_wr_cnt >= FLASHMAP_MAX_RECORDS) {
+		return VCFG_ERR_FULL;
+	}
+	if (rec->ir <= flashmap_wr_last || rec->kc == 0) {
+		return VCFG_ERR_ARG; // out of order, a duplicate or empty
+	}
+	flashmap_wr_last = rec->ir;
+
+	uint16_t offset = flashmap_wr_cnt * sizeof(keymap_rec_t);
+	uint16_t page = offset - (offset % SPM_PAGESIZE);
+	if (offset == page && page != FLASHMAP_SIZE - SPM_PAGESIZE) {
+		flashmap_spm(FLASHMAP_ERASE, page, 0); // the header page was erased by flashmap_begin
+	}
+	flashmap_fill(offset, (uint8_t*)rec, sizeof(keymap_rec_t));
+	for (uint8_t i = 0; i < sizeof(keymap_rec_t); i++) {
+		flashmap_wr_crc = _crc16_update(flashmap_wr_crc, ((uint8_t*)rec)[i]);
+	}
+	flashmap_wr_cnt++;
+
+	offset += sizeof(keymap_rec_t);
+	if ((offset % SPM_PAGESIZE) == 0)
+	{
+		// page full, this never happens to the last page because the header is in there
+		flashmap_write(page);
+	}
+	return VCFG_OK;
+}
+
+// writes the header, which makes the new keymap valid
+uint8_t flashmap_commit()
+{
+	if (flashmap_writing == 0) {
+		return VCFG_ERR_CMD;
+	}
+	uint16_t offset = flashmap_wr_cnt * sizeof(keymap_rec_t);
+	if ((offset % SPM_PAGESIZE) != 0 && offset < FLASHMAP_SIZE - SPM_PAGESIZE)
+	{
+		// the records stopped part way into a page before the last one
+		uint16_t page = offset - (offset % SPM_PAGESIZE);
+		flashmap_fill(offset, 0, page + SPM_PAGESIZE - offset);
+		flashmap_write(page);
+		usbPollWrapper(); // between the two page writes, so USB is never stopped for longer than one
+	}
+	if (offset < FLASHMAP_SIZE - SPM_PAGESIZE) {
+		offset = FLASHMAP_SIZE - SPM_PAGESIZE;
+	}
+
+	keymap_hdr_t hdr;
+	hdr.magic = KEYMAP_MAGIC;
+	hdr.version = KEYMAP_VERSION;
+	hdr.count = flashmap_wr_cnt;
+	hdr.crc = flashmap_wr_crc;
+	flashmap_fill(offset, 0, FLASHMAP_HDR_OFFSET - offset);
+	flashmap_fill(FLASHMAP_HDR_OFFSET, (uint8_t*)&hdr, sizeof(keymap_hdr_t));
+	flashmap_fill(FLASHMAP_HDR_OFFSET + sizeof(keymap_hdr_t), 0, FLASHMAP_SIZE - FLASHMAP_HDR_OFFSET - sizeof(keymap_hdr_t));
+	flashmap_write(FLASHMAP_SIZE - SPM_PAGESIZE);
+
+	flashmap_writing = 0;
+	flashmap_init(); // read back, so a failed write is not used
+	return (flashmap_cnt == flashmap_wr_cnt) ? VCFG_OK : VCFG_ERR_ARG;
+}
+
+#endif
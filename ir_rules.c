@@ -0,0 +1,48 @@
+#include "main.h"
+#include <avr/pgmspace.h>
+
+#ifdef ENABLE_IR_RULES
+
+// the rules are defined in nec_defaults.h
+const PROGMEM ir_rule_t ir_rule_tbl[] = IR_RULES;
+
+// does a single pass over the rule table, returning the keycode of the first rule matching the IR code
+// or 0 if no rule matches
+uint32_t ir_rule_match(uint32_t ircode)
+{
+	uint16_t addr = ircode & 0xFFFF;
+	uint8_t cmd = ircode >> 16;
+	char inv_ok = (uint8_t)(ircode >> 24) == (uint8_t)~cmd; // a corrupted frame can otherwise look like a different command
+
+	for (const ir_rule_t* p = ir_rule_tbl; ; p++)
+	{
+		ir_rule_t r;
+		memcpy_P((void*)&r, p, sizeof(ir_rule_t));
+		if (r.kc == 0) {
+			// end of table
+			break;
+		}
+		if (((addr ^ r.addr) & r.addr_mask) == 0 && cmd >= r.cmd_min && cmd <= r.cmd_max && (inv_ok || (r.flags & IR_RULE_ANY_ID)))
+		{
+			if (r.flags & IR_RULE_OFFSET) {
+				r.kc += (uint32_t)(cmd - r.cmd_min) << 24; // the keycode is in bits 24-31
+			}
+			return r.kc;
+		}
+	}
+
+	return 0;
+}
+
+#ifdef ENABLE_ADDR_FILTER
+// allows every address covered by a rule through the address filter
+void ir_rule_addr_filter_add()
+{
+	for (const ir_rule_t* p = ir_rule_tbl; pgm_read_dword(&p->kc) != 0; p++)
+	{
+		addr_filter_add(pgm_read_word(&p->addr), pgm_read_word(&p->addr_mask));
+	}
+}
+#endif
+
+#endif
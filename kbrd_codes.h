@@ -123,13 +123,43 @@
 #define KEYCODE_MOD_RIGHT_ALT		0x4001
 #define KEYCODE_MOD_RIGHT_GUI		0x8001
 
-#define MOUSECODE_UP			0x80000004
+// the motion codes only give the direction, holding the button moves the pointer faster and faster (see pointer_move)
+#define MOUSECODE_UP			0x81000004
 #define MOUSECODE_DOWN			0x7F000004
-#define MOUSECODE_LEFT			0x00800004
+#define MOUSECODE_LEFT			0x00810004
 #define MOUSECODE_RIGHT			0x007F0004
-#define MOUSECODE_BUT_RIGHT		0x00000104
-#define MOUSECODE_BUT_MIDDLE	0x00000204
-#define MOUSECODE_BUT_LEFT		0x00000404
+#define MOUSECODE_BUT_LEFT		0x00000104
+#define MOUSECODE_BUT_RIGHT		0x00000204
+#define MOUSECODE_BUT_MIDDLE	0x00000404
 // well since we are cheating by using uint32_t instead of a struct, we can't fit the mouse wheel in here
 
+// bits 4-7 of a keycode for report IDs 1 to 15 can choose how the key repeats (see TYPEMATIC_CLASS_TBL in profiles.h)
+// so learned and uploaded keymaps can set it per button, like KEYCODE_ARROW_UP | KEYCODE_TM_ONCE
+// they are 0 in the keycodes above, which means the class in TYPEMATIC_KEY_PAIRS, chords and function codes cannot have them
+#define KEYCODE_TM_MASK				0x000000F0
+#define KEYCODE_TM_HOLD				0x00000010
+#define KEYCODE_TM_ONCE				0x00000020
+#define KEYCODE_TM_NAV				0x00000030
+#define KEYCODE_TM_VOLUME			0x00000040
+#define KEYCODE_HAS_TM(kc)			(((kc) & 0x0F) != 0 && ((kc) & KEYCODE_TM_MASK) != 0)
+
+// function codes are never sent to the computer, they are handled by the IR keyboard itself
+// bits 0-7 is KEYCODE_FN_REPORT_ID, bits 8-15 is the function, bits 24-31 is the argument
+#define KEYCODE_FN_REPORT_ID		0xF0
+#define KEYCODE_FN_PROFILE_NEXT		0x000001F0
+#define KEYCODE_FN_PROFILE(n)		(0x000002F0 | ((uint32_t)(n) << 24))
+#define KEYCODE_FN_SHIFT			0x000003F0
+#define KEYCODE_FN_POINTER			0x000004F0 // turns pointer mode on and off, see pointer_translate
+
+// chords press several keys in one keyboard report, for shortcuts that need more than one key besides the modifiers
+// bits 0-7 is KEYCODE_CHORD_REPORT_ID, bits 24-31 is the entry in CHORD_TBL (see profiles.h)
+#define KEYCODE_CHORD_REPORT_ID		0x10
+#define KEYCODE_CHORD(n)			(0x00000010 | ((uint32_t)(n) << 24))
+#define KEYCODE_CTRL_ALT_DEL		0x00000010
+#define KEYCODE_CTRL_SHIFT_ESC		0x01000010
+#define KEYCODE_ALT_TAB_SHIFT		0x02000010
+// for writing CHORD_TBL with the keycodes above
+#define CHORD_MOD(kc)				((uint8_t)((kc) >> 8))
+#define CHORD_KEY(kc)				((uint8_t)((kc) >> 24))
+
 #endif
\ No newline at end of file
@@ -0,0 +1,393 @@
+#include "main.h"
+#include "profiles.h"
+#include <avr/pgmspace.h>
+
+// the keymap is a list of layers, each layer is asked for the IR code in order and the first one that knows it wins
+// every layer does one bounded lookup, so a code that nobody knows costs one probe per layer and nothing more
+// the keycode that was found is then passed through the MMKEY translation exactly once
+
+// binary search of a table of IR code and keycode pairs sorted by IR code
+// returns 0 if not found
+uint32_t pair_tbl_search(const uint32_t* tbl, uint8_t cnt, uint32_t ircode)
+{
+	uint8_t lo = 0, hi = cnt;
+	while (lo < hi)
+	{
+		uint8_t mid = (lo + hi) / 2;
+		uint32_t tblVal = pgm_read_dword(&tbl[mid * 2]);
+		if (tblVal == ircode) {
+			return pgm_read_dword(&tbl[mid * 2 + 1]); // found, return the key
+		}
+		if (tblVal < ircode) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return 0;
+}
+
+#ifdef ENABLE_DEFAULT_CODES
+const PROGMEM uint32_t ir_but_tbl[] = IR_BUT_PAIRS;
+#define IR_BUT_TBL_CNT ((sizeof(ir_but_tbl) / (sizeof(uint32_t) * 2)) - 1) // not counting the null termination
+
+static uint32_t default_ir_to_kb(uint32_t ircode)
+{
+	return pair_tbl_search(ir_but_tbl, IR_BUT_TBL_CNT, ircode);
+}
+#endif
+
+#ifdef ENABLE_PROFILES
+typedef struct
+{
+	const uint32_t*	tbl;
+	uint8_t			cnt;
+}
+keymap_profile_t;
+
+// the profiles are defined in profiles.h
+#define PROFILE_DEFINE(id)																	\
+	const PROGMEM uint32_t profile_pairs_##id[] = PROFILE_PAIRS_##id;
+#define PROFILE_ENTRY(id)																	\
+	{ .tbl = profile_pairs_##id, .cnt = sizeof(profile_pairs_##id) / (sizeof(uint32_t) * 2) },
+
+PROFILE_LIST(PROFILE_DEFINE)
+
+const PROGMEM keymap_profile_t profile_dir[] = {
+	{ .tbl = 0, .cnt = 0 }, // the default tables
+	PROFILE_LIST(PROFILE_ENTRY)
+};
+#define PROFILE_CNT (sizeof(profile_dir) / sizeof(keymap_profile_t))
+
+static uint8_t profile_idx = 0; // active profile
+static keymap_profile_t profile; // RAM copy of the active profile's directory entry
+
+static void profile_select(uint8_t idx)
+{
+	if (idx >= PROFILE_CNT) idx = 0;
+	profile_idx = idx;
+	memcpy_P((void*)&profile, &profile_dir[idx], sizeof(keymap_profile_t));
+	settings_set(SETTING_PROFILE, idx); // only written when the profile actually changes
+}
+
+static uint32_t profile_ir_to_kb(uint32_t ircode)
+{
+	return pair_tbl_search(profile.tbl, profile.cnt, ircode);
+}
+#endif
+
+#ifdef ENABLE_SHIFT_LAYER
+const PROGMEM uint32_t shift_tbl[] = SHIFT_PAIRS;
+#define SHIFT_TBL_CNT (sizeof(shift_tbl) / (sizeof(uint32_t) * 2))
+
+// the shift button is active from when it is pressed until the release timeout after it (see keymap_release)
+// every button pressed in that time is shifted, remotes that send the new button while the old one is still held do this
+// if no button was shifted meanwhile, letting go of the shift button arms it for the next press only
+// so a tap works however long it took, even if repeat frames arrived
+enum
+{
+	SHIFT_OFF,
+	SHIFT_ONESHOT,
+	SHIFT_HELD, // the shift button is held, nothing was shifted yet
+	SHIFT_HELD_USED // the shift button is held and shifted a button
+};
+static uint8_t shift_state = SHIFT_OFF;
+
+static uint32_t shift_ir_to_kb(uint32_t ircode)
+{
+	if (shift_state == SHIFT_OFF) {
+		return 0;
+	}
+	if (shift_state == SHIFT_ONESHOT) {
+		shift_state = SHIFT_OFF; // used up by this press, even if it is not in the shift layer
+	}
+	else {
+		shift_state = SHIFT_HELD_USED;
+	}
+	return pair_tbl_search(shift_tbl, SHIFT_TBL_CNT, ircode);
+}
+#endif
+
+typedef uint32_t (*keymap_layer_t)(uint32_t);
+
+// the layers in order of precedence, codes the user learned override everything else
+const PROGMEM keymap_layer_t keymap_layers[] = {
+	#ifdef ENABLE_SHIFT_LAYER
+	shift_ir_to_kb, // only while shifted
+	#endif
+	usr_ir_to_kb, // learned codes
+	#ifdef ENABLE_FLASH_KEYMAP
+	flashmap_ir_to_kb, // uploaded into flash
+	#endif
+	#ifdef ENABLE_PROFILES
+	profile_ir_to_kb, // active profile
+	#endif
+	#ifdef ENABLE_DEFAULT_CODES
+	default_ir_to_kb, // built-in tables
+	#endif
+	#ifdef ENABLE_IR_RULES
+	ir_rule_match, // vendor rules
+	#endif
+};
+
+// this function finds the keycode for an IR code by asking each layer in turn
+// returns 0 if not found
+uint32_t ir_to_kb(uint32_t ircode)
+{
+	for (uint8_t i = 0; i < sizeof(keymap_layers) / sizeof(keymap_layer_t); i++)
+	{
+		keymap_layer_t layer = (keymap_layer_t)pgm_read_word(&keymap_layers[i]);
+		uint32_t r = layer(ircode);
+		if (r != 0) {
+			// the typematic bits stay with the translated keycode
+			uint32_t tm = KEYCODE_HAS_TM(r) ? (r & KEYCODE_TM_MASK) : 0;
+			return mmkey_translate(r & ~tm) | tm;
+		}
+	}
+
+	return 0; // not found
+}
+
+// loads the saved keymap state, must be called once at start-up after settings_init
+void keymap_init()
+{
+	#ifdef ENABLE_PROFILES
+	profile_select(settings_get(SETTING_PROFILE));
+	#endif
+}
+
+// performs the action of a function code (see KEYCODE_FN_REPORT_ID)
+// returns how many times the LED should blink to confirm it, 0 for no blinking
+uint8_t keymap_fn(uint32_t kc)
+{
+	uint8_t fn = kc >> 8;
+	uint8_t arg = kc >> 24;
+	(void)fn; (void)arg; // when no function is enabled
+
+	#ifdef ENABLE_PROFILES
+	if (fn == (uint8_t)(KEYCODE_FN_PROFILE_NEXT >> 8)) {
+		profile_select(profile_idx + 1);
+		return profile_idx + 1;
+	}
+	if (fn == (uint8_t)(KEYCODE_FN_PROFILE(0) >> 8)) {
+		profile_select(arg);
+		return profile_idx + 1;
+	}
+	#endif
+
+	#ifdef ENABLE_SHIFT_LAYER
+	if (fn == (uint8_t)(KEYCODE_FN_SHIFT >> 8)) {
+		shift_state = SHIFT_HELD; // becomes a one-shot when it is let go of, see keymap_release
+		return 0;
+	}
+	#endif
+
+	#ifdef ENABLE_MOUSE
+	if (fn == (uint8_t)(KEYCODE_FN_POINTER >> 8)) {
+		return pointer_toggle() ? 2 : 1; // two blinks for on, one for off
+	}
+	#endif
+
+	return 0;
+}
+
+const PROGMEM keymap_chord_t chord_tbl[] = CHORD_TBL;
+#define CHORD_TBL_CNT (sizeof(chord_tbl) / sizeof(keymap_chord_t))
+
+// reads the keys of a chord (see KEYCODE_CHORD), returns 0 if there is no such chord
+char keymap_chord(uint8_t n, keymap_chord_t* c)
+{
+	if (n >= CHORD_TBL_CNT) {
+		return 0;
+	}
+	memcpy_P((void*)c, &chord_tbl[n], sizeof(keymap_chord_t));
+	return 1;
+}
+
+const PROGMEM typematic_class_t typematic_class_tbl[TYPEMATIC_CLASS_CNT] = TYPEMATIC_CLASS_TBL;
+const PROGMEM uint32_t typematic_key_tbl[] = TYPEMATIC_KEY_PAIRS;
+#define TYPEMATIC_KEY_TBL_CNT (sizeof(typematic_key_tbl) / (sizeof(uint32_t) * 2))
+
+// finds how a keycode repeats, returns its class and reads the timing of the class
+// the class comes from the KEYCODE_TM_ bits if the keymap set them (they are taken off the keycode), else from TYPEMATIC_KEY_PAIRS
+uint8_t keymap_typematic(uint32_t* kc, typematic_class_t* c)
+{
+	uint8_t cls = TYPEMATIC_HOLD;
+	if (KEYCODE_HAS_TM(*kc))
+	{
+		cls = ((*kc & KEYCODE_TM_MASK) >> 4) - 1;
+		*kc &= ~KEYCODE_TM_MASK;
+		if (cls >= TYPEMATIC_CLASS_CNT) {
+			cls = TYPEMATIC_HOLD;
+		}
+	}
+	else
+	{
+		for (uint8_t i = 0; i < TYPEMATIC_KEY_TBL_CNT; i++)
+		{
+			if (pgm_read_dword(&typematic_key_tbl[i * 2]) == *kc) {
+				cls = pgm_read_dword(&typematic_key_tbl[i * 2 + 1]);
+				break;
+			}
+		}
+	}
+	memcpy_P((void*)c, &typematic_class_tbl[cls], sizeof(typematic_class_t));
+	return cls;
+}
+
+// returns the active profile, 0 is the default
+uint8_t keymap_profile_get()
+{
+	#ifdef ENABLE_PROFILES
+	return profile_idx;
+	#else
+	return 0;
+	#endif
+}
+
+// called when the release timeout decides that no button is held anymore
+void keymap_release()
+{
+	#ifdef ENABLE_SHIFT_LAYER
+	if (shift_state == SHIFT_HELD) {
+		shift_state = SHIFT_ONESHOT; // nothing was shifted while it was held, so it was a tap
+	}
+	else if (shift_state == SHIFT_HELD_USED) {
+		shift_state = SHIFT_OFF;
+	}
+	#endif
+}
+
+// allows the address of every remote known to any layer through the address filter
+void keymap_addr_filter_add()
+{
+	#ifdef ENABLE_ADDR_FILTER
+	usr_addr_filter_add();
+
+	#ifdef ENABLE_FLASH_KEYMAP
+	flashmap_addr_filter_add();
+	#endif
+
+	#ifdef ENABLE_DEFAULT_CODES
+	for (uint8_t i = 0; i < IR_BUT_TBL_CNT; i++)
+	{
+		addr_filter_add(pgm_read_dword(&ir_but_tbl[i * 2]) & 0xFFFF, 0xFFFF);
+	}
+	#endif
+
+	#ifdef ENABLE_SHIFT_LAYER
+	for (uint8_t i = 0; i < SHIFT_TBL_CNT; i++)
+	{
+		addr_filter_add(pgm_read_dword(&shift_tbl[i * 2]) & 0xFFFF, 0xFFFF);
+	}
+	#endif
+
+	#ifdef ENABLE_PROFILES
+	for (uint8_t p = 0; p < PROFILE_CNT; p++)
+	{
+		keymap_profile_t pr;
+		memcpy_P((void*)&pr, &profile_dir[p], sizeof(keymap_profile_t));
+		for (uint8_t i = 0; i < pr.cnt; i++)
+		{
+			addr_filter_add(pgm_read_dword(&pr.tbl[i * 2]) & 0xFFFF, 0xFFFF);
+		}
+	}
+	#endif
+
+	#ifdef ENABLE_IR_RULES
+	ir_rule_addr_filter_add();
+	#endif
+	#endif
+}
+
+#ifdef ENABLE_MMKEY_TRANSLATE
+const PROGMEM uint32_t mmkey_tbl[] = MMKEY_TRANSLATE_PAIRS;
+static uint8_t mmkey_mode = 0; // active translation mode, 0 means no translation
+static uint8_t mmkey_mode_cnt = 0; // number of translation modes in mmkey_tbl, not counting mode 0
+static const uint32_t* mmkey_sect; // first pair of the active mode's section in mmkey_tbl
+
+// locates the section of mmkey_tbl belonging to a translation mode and makes it the active one
+// this only runs at start-up and on a mode change, so translating a key never has to search for its section
+static void mmkey_select(uint8_t mode)
+{
+	const uint32_t* p = mmkey_tbl;
+	mmkey_mode = 0;
+	mmkey_mode_cnt = 0;
+	while (pgm_read_dword(p) != 0) // an empty section ends the table
+	{
+		mmkey_mode_cnt++;
+		if (mmkey_mode_cnt == mode) {
+			mmkey_mode = mode;
+			mmkey_sect = p;
+		}
+		while (pgm_read_dword(p) != 0) p += 2; // skip to the end of this section
+		p += 2;
+	}
+}
+#endif
+
+// selects the translation mode that was saved and returns it
+uint8_t mmkey_init()
+{
+	#ifdef ENABLE_MMKEY_TRANSLATE
+	// the setting is the mode minus one, so an erased byte (0xFF) means mode 0
+	mmkey_select(settings_get(SETTING_MMKEY) + 1);
+	return mmkey_mode;
+	#else
+	return 0;
+	#endif
+}
+
+// cycles to the next translation mode, wrapping back around to no translation, and returns the new mode
+uint8_t mmkey_next()
+{
+	#ifdef ENABLE_MMKEY_TRANSLATE
+	uint8_t m = mmkey_mode + 1;
+	if (m > mmkey_mode_cnt) m = 0;
+	mmkey_set(m);
+	return m;
+	#else
+	return 0;
+	#endif
+}
+
+uint8_t mmkey_get()
+{
+	#ifdef ENABLE_MMKEY_TRANSLATE
+	return mmkey_mode;
+	#else
+	return 0;
+	#endif
+}
+
+// selects a translation mode and saves it, a mode that does not exist selects no translation
+void mmkey_set(uint8_t m)
+{
+	#ifdef ENABLE_MMKEY_TRANSLATE
+	mmkey_select(m);
+	settings_set(SETTING_MMKEY, mmkey_mode - 1); // only written when the mode actually changes
+	#endif
+}
+
+uint32_t mmkey_translate(uint32_t kc)
+{
+	#ifdef ENABLE_MMKEY_TRANSLATE
+	if (mmkey_mode != 0)
+	{
+		for (const uint32_t* p = mmkey_sect; ; p += 2)
+		{
+			uint32_t tblVal = pgm_read_dword(p);
+			if (tblVal == 0) {
+				// end of section
+				break;
+			}
+			if (tblVal == kc) {
+				return pgm_read_dword(p + 1);
+			}
+		}
+	}
+	#endif
+
+	return kc;
+}
@@ -0,0 +1,103 @@
+#ifndef LAYOUTS_H
+#define LAYOUTS_H
+
+// host keyboard layouts for typing out text (printf), see ASCII_to_keycode in main.c
+// the host turns keycodes into characters with its own layout, so to type a character the key that has it on that layout must be sent
+// KEYBOARD_LAYOUT picks the layout at build time, with ENABLE_LAYOUT_SELECT all of them are built in and SETTING_LAYOUT picks one
+
+// X(identifier), in the order of their SETTING_LAYOUT value
+#define LAYOUT_LIST(X)	\
+X(US)					\
+X(UK)					\
+X(DE)					\
+X(FR)
+
+#define LAYOUT_ENUM(id) LAYOUT_##id,
+enum
+{
+	LAYOUT_LIST(LAYOUT_ENUM)
+	LAYOUT_CNT
+};
+#define LAYOUT_IDX_(id) LAYOUT_##id
+#define LAYOUT_IDX(id) LAYOUT_IDX_(id) // expands the argument first, for KEYBOARD_LAYOUT
+
+#ifndef KEYBOARD_LAYOUT
+#define KEYBOARD_LAYOUT US
+#endif
+
+// every layout is a table of one byte for each character from ' ' (0x20) to DEL (0x7F), 0 if it cannot be typed
+// bits 0-5 is the keycode (bits 24-31 of a KEYCODE_), bit 6 is shift and bit 7 is AltGr (right alt)
+// only keycode 0x64 (the key next to left shift on ISO keyboards) does not fit in 6 bits, LNUS stands for it
+#define LS(k)		(0x40 | (k))
+#define LA(k)		(0x80 | (k))
+#define LNUS		0x3F
+#define LAYOUT_TBL_SIZE (0x80 - 0x20)
+
+// every layout also has a string of its dead keys, characters that only come out after another key
+// they are typed followed by a space
+
+#define LAYOUT_DEAD_US ""
+#define LAYOUT_TBL_US {	\
+/*  !"#$%&' */ 0x2C, LS(0x1E), LS(0x34), LS(0x20), LS(0x21), LS(0x22), LS(0x24), 0x34,	\
+/* ()*+,-./ */ LS(0x26), LS(0x27), LS(0x25), LS(0x2E), 0x36, 0x2D, 0x37, 0x38,	\
+/* 01234567 */ 0x27, 0x1E, 0x1F, 0x20, 0x21, 0x22, 0x23, 0x24,	\
+/* 89:;<=>? */ 0x25, 0x26, LS(0x33), 0x33, LS(0x36), 0x2E, LS(0x37), LS(0x38),	\
+/* @ABCDEFG */ LS(0x1F), LS(0x04), LS(0x05), LS(0x06), LS(0x07), LS(0x08), LS(0x09), LS(0x0A),	\
+/* HIJKLMNO */ LS(0x0B), LS(0x0C), LS(0x0D), LS(0x0E), LS(0x0F), LS(0x10), LS(0x11), LS(0x12),	\
+/* PQRSTUVW */ LS(0x13), LS(0x14), LS(0x15), LS(0x16), LS(0x17), LS(0x18), LS(0x19), LS(0x1A),	\
+/* XYZ[\]^_ */ LS(0x1B), LS(0x1C), LS(0x1D), 0x2F, 0x31, 0x30, LS(0x23), LS(0x2D),	\
+/* `abcdefg */ 0x35, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A,	\
+/* hijklmno */ 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0x10, 0x11, 0x12,	\
+/* pqrstuvw */ 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1A,	\
+/* xyz{|}~  */ 0x1B, 0x1C, 0x1D, LS(0x2F), LS(0x31), LS(0x30), LS(0x35), 0,	\
+}
+
+#define LAYOUT_DEAD_UK ""
+#define LAYOUT_TBL_UK {	\
+/*  !"#$%&' */ 0x2C, LS(0x1E), LS(0x1F), 0x32, LS(0x21), LS(0x22), LS(0x24), 0x34,	\
+/* ()*+,-./ */ LS(0x26), LS(0x27), LS(0x25), LS(0x2E), 0x36, 0x2D, 0x37, 0x38,	\
+/* 01234567 */ 0x27, 0x1E, 0x1F, 0x20, 0x21, 0x22, 0x23, 0x24,	\
+/* 89:;<=>? */ 0x25, 0x26, LS(0x33), 0x33, LS(0x36), 0x2E, LS(0x37), LS(0x38),	\
+/* @ABCDEFG */ LS(0x34), LS(0x04), LS(0x05), LS(0x06), LS(0x07), LS(0x08), LS(0x09), LS(0x0A),	\
+/* HIJKLMNO */ LS(0x0B), LS(0x0C), LS(0x0D), LS(0x0E), LS(0x0F), LS(0x10), LS(0x11), LS(0x12),	\
+/* PQRSTUVW */ LS(0x13), LS(0x14), LS(0x15), LS(0x16), LS(0x17), LS(0x18), LS(0x19), LS(0x1A),	\
+/* XYZ[\]^_ */ LS(0x1B), LS(0x1C), LS(0x1D), 0x2F, LNUS, 0x30, LS(0x23), LS(0x2D),	\
+/* `abcdefg */ 0x35, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A,	\
+/* hijklmno */ 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0x10, 0x11, 0x12,	\
+/* pqrstuvw */ 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1A,	\
+/* xyz{|}~  */ 0x1B, 0x1C, 0x1D, LS(0x2F), LS(LNUS), LS(0x30), LS(0x32), 0,	\
+}
+
+#define LAYOUT_DEAD_DE "^`"
+#define LAYOUT_TBL_DE {	\
+/*  !"#$%&' */ 0x2C, LS(0x1E), LS(0x1F), 0x32, LS(0x21), LS(0x22), LS(0x23), LS(0x32),	\
+/* ()*+,-./ */ LS(0x25), LS(0x26), LS(0x30), 0x30, 0x36, 0x38, 0x37, LS(0x24),	\
+/* 01234567 */ 0x27, 0x1E, 0x1F, 0x20, 0x21, 0x22, 0x23, 0x24,	\
+/* 89:;<=>? */ 0x25, 0x26, LS(0x37), LS(0x36), LNUS, LS(0x27), LS(LNUS), LS(0x2D),	\
+/* @ABCDEFG */ LA(0x14), LS(0x04), LS(0x05), LS(0x06), LS(0x07), LS(0x08), LS(0x09), LS(0x0A),	\
+/* HIJKLMNO */ LS(0x0B), LS(0x0C), LS(0x0D), LS(0x0E), LS(0x0F), LS(0x10), LS(0x11), LS(0x12),	\
+/* PQRSTUVW */ LS(0x13), LS(0x14), LS(0x15), LS(0x16), LS(0x17), LS(0x18), LS(0x19), LS(0x1A),	\
+/* XYZ[\]^_ */ LS(0x1B), LS(0x1D), LS(0x1C), LA(0x25), LA(0x2D), LA(0x26), 0x35, LS(0x38),	\
+/* `abcdefg */ LS(0x2E), 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A,	\
+/* hijklmno */ 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0x10, 0x11, 0x12,	\
+/* pqrstuvw */ 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1A,	\
+/* xyz{|}~  */ 0x1B, 0x1D, 0x1C, LA(0x24), LA(LNUS), LA(0x27), LA(0x30), 0,	\
+}
+
+#define LAYOUT_DEAD_FR "`~"
+#define LAYOUT_TBL_FR {	\
+/*  !"#$%&' */ 0x2C, 0x38, 0x20, LA(0x20), 0x30, LS(0x34), 0x1E, 0x21,	\
+/* ()*+,-./ */ 0x22, 0x2D, 0x32, LS(0x2E), 0x10, 0x23, LS(0x36), LS(0x37),	\
+/* 01234567 */ LS(0x27), LS(0x1E), LS(0x1F), LS(0x20), LS(0x21), LS(0x22), LS(0x23), LS(0x24),	\
+/* 89:;<=>? */ LS(0x25), LS(0x26), 0x37, 0x36, LNUS, 0x2E, LS(LNUS), LS(0x10),	\
+/* @ABCDEFG */ LA(0x27), LS(0x14), LS(0x05), LS(0x06), LS(0x07), LS(0x08), LS(0x09), LS(0x0A),	\
+/* HIJKLMNO */ LS(0x0B), LS(0x0C), LS(0x0D), LS(0x0E), LS(0x0F), LS(0x33), LS(0x11), LS(0x12),	\
+/* PQRSTUVW */ LS(0x13), LS(0x04), LS(0x15), LS(0x16), LS(0x17), LS(0x18), LS(0x19), LS(0x1D),	\
+/* XYZ[\]^_ */ LS(0x1B), LS(0x1C), LS(0x1A), LA(0x22), LA(0x25), LA(0x2D), LA(0x26), 0x25,	\
+/* `abcdefg */ LA(0x24), 0x14, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A,	\
+/* hijklmno */ 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0x33, 0x11, 0x12,	\
+/* pqrstuvw */ 0x13, 0x04, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1D,	\
+/* xyz{|}~  */ 0x1B, 0x1C, 0x1A, LA(0x21), LA(0x23), LA(0x2E), LA(0x1F), 0,	\
+}
+
+#endif
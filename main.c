@@ -10,12 +10,14 @@
 #include <avr/eeprom.h> // text file and calibration data is stored in EEPROM
 #include <stdio.h> // allows streaming strings
 #include <stdlib.h> // random numbers
+#include <string.h>
 
 // configure settings for V-USB then include the V-USB driver so V-USB uses your settings
 #include "usbconfig.h"
 #include "usbdrv/usbdrv.h"
 
 #include "main.h"
+#include "layouts.h"
 
 // USB HID report descriptor for boot protocol keyboard
 // see HID1_11.pdf appendix B section 1
@@ -119,31 +121,236 @@ const PROGMEM char usbHidReportDescriptor[USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH]
 	0xC0,             //   END_COLLECTION
 	0xC0,             // END COLLECTION
 #endif
+
+#ifdef ENABLE_VENDOR_CONFIG
+	// feature report for configuration, see vendor.c
+	0x06, 0x00, 0xFF, // USAGE_PAGE (Vendor Defined Page 1)
+	0x09, 0x01,       // USAGE (Vendor Usage 1)
+	0xA1, 0x01,       // COLLECTION (Application)
+	0x85, VCFG_REPORT_ID, // REPORT_ID (5)
+	0x15, 0x00,       //   LOGICAL_MINIMUM (0)
+	0x26, 0xFF, 0x00, //   LOGICAL_MAXIMUM (255)
+	0x75, 0x08,       //   REPORT_SIZE (8)
+	0x95, VCFG_REPORT_LEN - 1, // REPORT_COUNT, not counting the report ID
+	0x09, 0x01,       //   USAGE (Vendor Usage 1)
+	0xB1, 0x02,       //   FEATURE (Data,Var,Abs)
+	0xC0,             // END_COLLECTION
+#endif
 };
 
-#define OSCCAL_EEADDR         (const uint8_t *)(E2END - 2)
-#define MMKEY_TRANSLATE_EEADDR (const uint8_t *)(E2END - 4)
+#ifdef ENABLE_SECOND_ENDPOINT
+// a HID interface only has one interrupt-IN endpoint, so endpoint 3 needs an interface of its own
+// the first interface is the boot keyboard on endpoint 1, the second has the rest of the reports on endpoint 3
+// so keyboard reports never wait behind mouse or media reports
+const PROGMEM char usbDescriptorConfiguration[USB_CFG_CONFIGURATION_LENGTH] = {
+	9,                // bLength
+	USBDESCR_CONFIG,  // bDescriptorType
+	USB_CFG_CONFIGURATION_LENGTH, 0, // wTotalLength
+	2,                // bNumInterfaces
+	1,                // bConfigurationValue
+	0,                // iConfiguration
+	(1 << 7),         // bmAttributes, bus powered
+	USB_CFG_MAX_BUS_POWER / 2, // bMaxPower, in 2 mA units
+
+	9,                // bLength
+	USBDESCR_INTERFACE, // bDescriptorType
+	0,                // bInterfaceNumber
+	0,                // bAlternateSetting
+	1,                // bNumEndpoints
+	USB_CFG_INTERFACE_CLASS,
+	USB_CFG_INTERFACE_SUBCLASS,
+	USB_CFG_INTERFACE_PROTOCOL,
+	0,                // iInterface
+	9,                // bLength
+	USBDESCR_HID,     // bDescriptorType
+	0x01, 0x01,       // bcdHID
+	0x00,             // bCountryCode
+	1,                // bNumDescriptors
+	USBDESCR_HID_REPORT, // bDescriptorType
+	HID_RPT_DESC_LEN_KEYBOARD, 0, // wDescriptorLength
+	7,                // bLength
+	USBDESCR_ENDPOINT, // bDescriptorType
+	(char)0x81,       // bEndpointAddress, IN 1
+	0x03,             // bmAttributes, interrupt
+	8, 0,             // wMaxPacketSize
+	USB_CFG_INTR_POLL_INTERVAL, // bInterval
+
+	9,                // bLength
+	USBDESCR_INTERFACE, // bDescriptorType
+	1,                // bInterfaceNumber
+	0,                // bAlternateSetting
+	1,                // bNumEndpoints
+	0x03,             // bInterfaceClass, HID
+	0x00,             // bInterfaceSubClass, not boot
+	0x00,             // bInterfaceProtocol
+	0,                // iInterface
+	9,                // bLength
+	USBDESCR_HID,     // bDescriptorType
+	0x01, 0x01,       // bcdHID
+	0x00,             // bCountryCode
+	1,                // bNumDescriptors
+	USBDESCR_HID_REPORT, // bDescriptorType
+	HID_RPT_DESC_LEN_SECOND, 0, // wDescriptorLength
+	7,                // bLength
+	USBDESCR_ENDPOINT, // bDescriptorType
+	(char)(0x80 | USB_CFG_EP3_NUMBER), // bEndpointAddress, IN 3
+	0x03,             // bmAttributes, interrupt
+	8, 0,             // wMaxPacketSize
+	USB_CFG_INTR_POLL_INTERVAL, // bInterval
+};
+#define CFG_DESC_HID_OFFSET_0 (9 + 9) // HID descriptor of the first interface
+#define CFG_DESC_HID_OFFSET_1 (9 + 9 + 9 + 7 + 9) // HID descriptor of the second interface
+#endif
 
 // private local function prototypes
-uint32_t ir_to_kb(uint32_t);
-void send_report_once();
-void ASCII_to_keycode(uint8_t);
+static void report_init();
+static void report_clear(uint8_t);
+static char report_set_kc(uint32_t);
+static char report_kb_press(keyboard_report_t*, uint8_t, uint8_t);
+static void report_kb_release(keyboard_report_t*, uint8_t, uint8_t);
+static void report_queue(uint8_t);
+static void report_mark(uint8_t);
+static void report_tap(uint8_t);
+static void typematic_task();
+#ifdef ENABLE_MOUSE
+static uint32_t pointer_translate(uint32_t);
+static char pointer_move(uint32_t);
+static void pointer_task();
+#endif
+char ASCII_to_keycode(uint8_t, keyboard_report_t*);
 void type_out_char(uint8_t, FILE*);
+static void type_char(uint8_t);
+#ifdef ENABLE_ADDR_FILTER
+static char addr_filter_check(uint32_t);
+static void ir_timing_restore();
+#endif
 static FILE mystdout = FDEV_SETUP_STREAM(type_out_char, NULL, _FDEV_SETUP_WRITE); // setup writing stream
 
 // global variables
 
-static keyboard_report_t keyboard_report;
-#define keyboard_report_reset() do { *((uint32_t*)(&keyboard_report)) &= 0x000000FF; } while (0)
-static uint8_t idle_rate = 500 / 4; // see HID1_11.pdf sect 7.2.4
+// the current state of each report, every report ID has its own so they are pressed and released independently
+// each one starts with its report ID, see report_init
+static keyboard_report_t keyboard_report; // ID 1
+#ifdef ENABLE_CONSUMER
+static uint8_t consumer_report[3]; // ID 2, 16 bit usage
+#endif
+#ifdef ENABLE_SYS_CONTROL
+static uint8_t sys_report[2]; // ID 3, 8 bit usage
+#endif
+#ifdef ENABLE_MOUSE
+static uint8_t mouse_report[4]; // ID 4, buttons, X and Y
+#endif
+#define REPORT_ID_MAX 4
+
+// where the state of each report ID is and how long it is, 0 for IDs that are not in the report descriptor
+typedef struct
+{
+	uint8_t*	st;
+	uint8_t		len;
+}
+report_info_t;
+const PROGMEM report_info_t report_tbl[REPORT_ID_MAX + 1] = {
+	{ 0, 0 },
+	{ (uint8_t*)&keyboard_report, sizeof(keyboard_report_t) },
+	#ifdef ENABLE_CONSUMER
+	{ consumer_report, sizeof(consumer_report) },
+	#else
+	{ 0, 0 },
+	#endif
+	#ifdef ENABLE_SYS_CONTROL
+	{ sys_report, sizeof(sys_report) },
+	#else
+	{ 0, 0 },
+	#endif
+	#ifdef ENABLE_MOUSE
+	{ mouse_report, sizeof(mouse_report) },
+	#else
+	{ 0, 0 },
+	#endif
+};
+#define report_state(id) ((uint8_t*)pgm_read_word(&report_tbl[(id)].st))
+#define report_size(id) pgm_read_byte(&report_tbl[(id)].len)
+static uint8_t report_dirty = 0; // bit n is set if report ID n changed and the change was not queued or sent yet
+static uint8_t idle_rate[REPORT_ID_MAX + 1]; // per report ID in 4 ms units, 0 means only send on change, see HID1_11.pdf sect 7.2.4
+static uint16_t report_ms[REPORT_ID_MAX + 1]; // when each report ID was last sent, for the idle rate
+static volatile uint16_t ms_now = 0; // counted by the Timer1 interrupt
 static uint8_t protocol_version = 0; // see HID1_11.pdf sect 7.2.6
 static uint8_t LED_state = 0; // see HID1_11.pdf appendix B section 1
-static char report_pending = 0; // if we need to send out a report
+static volatile char osccal_dirty = 0; // OSCCAL was calibrated and needs to be saved
+#ifdef ENABLE_VENDOR_CONFIG
+static char usb_write_vcfg = 0; // if usbFunctionWrite is receiving the vendor report instead of the LED report
+#endif
+#define REPORT_FIFO_SIZE 4 // enough for a key press, its release and a report of another ID, or one typed character
+typedef struct
+{
+	keyboard_report_t	buf[REPORT_FIFO_SIZE]; // copies of reports waiting to be sent, oldest first
+	uint8_t				head; // next free entry
+	uint8_t				cnt; // reports waiting
+}
+report_fifo_t;
+static report_fifo_t report_fifo; // for endpoint 1
+#ifdef ENABLE_SECOND_ENDPOINT
+static report_fifo_t report_fifo3; // for endpoint 3, every report but the keyboard
+#define report_fifo_of(id) (((id) == 1) ? &report_fifo : &report_fifo3)
+#define REPORT_EP1_IDS _BV(1) // the report IDs (as bits) sent on endpoint 1
+#else
+#define report_fifo_of(id) (&report_fifo)
+#define REPORT_EP1_IDS 0xFF
+#endif
+static uint8_t report_down_id = 0; // report ID of the key being held, 0 if no key is held
+static keyboard_report_t type_report; // the keys type_char holds, added to every keyboard report that is queued (see report_queue)
+static char type_held = 0; // if type_char left keys held, they are let go of once the FIFO is empty
+#define TYPE_BUF_SIZE 16
+#define TYPE_CHAR_REPORTS 4 // the most reports type_char queues for one character, a dead key and the space after it
+static uint8_t type_buf[TYPE_BUF_SIZE]; // characters written to stdout that are not typed yet
+static uint8_t type_buf_head = 0; // next free entry
+static uint8_t type_buf_cnt = 0; // characters waiting
 static int8_t bit_idx = 0; // bit index of current reception
 #define INDICATE_ERROR -10 // used for bit_idx to indicate error
+#define INDICATE_FOREIGN -8 // used for bit_idx to ignore the rest of a frame from an unknown remote
 static volatile char has_commed = 0; // if the host made any usb requests
 static uint32_t ir_code = 0; // current IR code being received
 static uint32_t last_keycode = 0; // the last keycode, used for key holding
+static uint16_t ir_frame_ms; // when the leading pulse of the last frame started
+static uint16_t ir_period_ms = NEC_PERIOD_MS; // how often the remote sends frames while a button is held, measured
+static char ir_active = 0; // a frame arrived and the next one is not late yet
+static typematic_class_t tm_class; // how the held key repeats
+static char tm_active = 0; // the held key is repeated by typematic_task
+static uint32_t tm_kc; // the held key
+static uint16_t tm_next_ms; // when the next repeat is due
+static uint8_t tm_cnt; // repeats so far, stops counting at accel_cnt
+#ifdef ENABLE_MOUSE
+#define POINTER_FRAME_MS USB_CFG_INTR_POLL_INTERVAL // one motion report per interrupt frame
+#define POINTER_SPEED_MIN 1 // pixels per frame when the button was just pressed
+#define POINTER_SPEED_MAX 24
+#define POINTER_ACCEL_MS 40 // one pixel per frame faster every this long the button is held
+static char pointer_on = 0; // pointer mode, the arrows move the mouse pointer and Enter/Return click
+static int8_t pointer_dx = 0, pointer_dy = 0; // direction of the held motion button, both 0 when not moving
+static uint16_t pointer_start_ms; // when the motion button was pressed
+static uint16_t pointer_last_ms; // when the last motion report was queued
+#endif
+#ifdef ENABLE_ADDR_FILTER
+#define ADDR_FILTER_SIZE 8
+static uint16_t addr_filter[ADDR_FILTER_SIZE][2]; // address and address mask of each remote we have codes for
+static uint8_t addr_filter_cnt = 0; // entries used in addr_filter, more than ADDR_FILTER_SIZE means it overflowed
+static char addr_filter_on = 0; // if the filter is off then every address is accepted
+static char ir_foreign = 0; // if the last frame was dropped, so its repeat frames are dropped too
+static uint16_t ir_prev_frame_ms, ir_prev_period_ms; // the release timing from before the leading pulse, put back if the frame is dropped
+static char ir_prev_active;
+#endif
+#ifdef ENABLE_FAST_LEARN
+// usr_prog_fast keeps the codes it learned here until it writes them all at the end, 0 means skipped
+// programming mode runs before the address filter is built, so it can borrow the filter's RAM
+#ifdef ENABLE_ADDR_FILTER
+#if ADDR_FILTER_SIZE < CODE_DESC_CNT
+#error "the address filter is too small to hold the codes of fast learn"
+#endif
+uint32_t* const fast_learn_codes = (uint32_t*)addr_filter;
+#else
+static uint32_t fast_learn_buf[CODE_DESC_CNT];
+uint32_t* const fast_learn_codes = fast_learn_buf;
+#endif
+#endif
 #ifdef ENABLE_TIMEBUFF_DEBUG
 static uint8_t time_buff[32*3];
 static uint8_t time_buff_idx = 0;
@@ -153,23 +360,63 @@ static uint8_t time_buff_idx = 0;
 #define buttonPressed()  bit_is_clear(JMP_PINx, JMP_PINNUM)
 uint8_t tryProgram = 1;
 
-#if defined(ENABLE_DEFAULT_CODES) || defined(ENABLE_APPLE_DEFAULTS)
-#include <nec_defaults.h>
-#if defined(ENABLE_DEFAULT_CODES)
-const PROGMEM uint32_t ir_but_tbl[] = IR_BUT_PAIRS;
-#endif
-#endif
-
 // delays a certain number of ms, but also servicing USB requests at the same time
 static void usb_polling_delay_ms(uint8_t x)
 {
 	uint8_t y;
 	for (y = 0; y < (x); y++) {
-		usbPoll();
+		usbPollWrapper(); // so reports and typed text keep going out
 		_delay_ms(1);
 	}
 }
 
+// blinks the LED a number of times while servicing USB, used to show which mode was selected
+static void led_blink(uint8_t n)
+{
+	while (n--)
+	{
+		LED_PORTx &= ~LED_PINMASK; // LED off
+		usb_polling_delay_ms(200);
+		LED_PORTx |=  LED_PINMASK; // LED on
+		usb_polling_delay_ms(200);
+	}
+	LED_PORTx &= ~LED_PINMASK; // LED off
+}
+
+// rapid flickering, different from the mode blinks, used to show that the stored keymap is corrupt
+static void led_fault_blink()
+{
+	for (uint8_t i = 0; i < 10; i++)
+	{
+		LED_PORTx |=  LED_PINMASK; // LED on
+		usb_polling_delay_ms(50);
+		LED_PORTx &= ~LED_PINMASK; // LED off
+		usb_polling_delay_ms(50);
+	}
+}
+
+#ifdef ENABLE_SECOND_ENDPOINT
+// the HID and report descriptors are different for each interface, wIndex is the interface
+usbMsgLen_t usbFunctionDescriptor(struct usbRequest* rq)
+{
+	if (rq->wValue.bytes[1] == USBDESCR_HID)
+	{
+		usbMsgPtr = (usbMsgPtr_t)&usbDescriptorConfiguration[(rq->wIndex.bytes[0] == 0) ? CFG_DESC_HID_OFFSET_0 : CFG_DESC_HID_OFFSET_1];
+		return 9;
+	}
+	if (rq->wValue.bytes[1] == USBDESCR_HID_REPORT)
+	{
+		if (rq->wIndex.bytes[0] == 0) {
+			usbMsgPtr = (usbMsgPtr_t)usbHidReportDescriptor;
+			return HID_RPT_DESC_LEN_KEYBOARD;
+		}
+		usbMsgPtr = (usbMsgPtr_t)&usbHidReportDescriptor[HID_RPT_DESC_LEN_KEYBOARD];
+		return HID_RPT_DESC_LEN_SECOND;
+	}
+	return 0;
+}
+#endif
+
 // see http://vusb.wikidot.com/driver-api
 // constants are found in usbdrv.h
 usbMsgLen_t usbFunctionSetup(uint8_t data[8])
@@ -186,10 +433,18 @@ usbMsgLen_t usbFunctionSetup(uint8_t data[8])
 	switch (rq->bRequest)
 	{
 		case USBRQ_HID_GET_IDLE:
-			usbMsgPtr = &idle_rate; // send data starting from this byte
+			if (rq->wValue.bytes[0] > REPORT_ID_MAX) {
+				return 0;
+			}
+			usbMsgPtr = &idle_rate[rq->wValue.bytes[0]]; // send data starting from this byte
 			return 1; // send 1 byte
 		case USBRQ_HID_SET_IDLE:
-			idle_rate = rq->wValue.bytes[1]; // read in idle rate
+			// report ID 0 means all of them
+			for (uint8_t id = 0; id <= REPORT_ID_MAX; id++) {
+				if (rq->wValue.bytes[0] == 0 || rq->wValue.bytes[0] == id) {
+					idle_rate[id] = rq->wValue.bytes[1]; // read in idle rate
+				}
+			}
 			return 0; // send nothing
 		case USBRQ_HID_GET_PROTOCOL:
 			usbMsgPtr = &protocol_version; // send data starting from this byte
@@ -198,23 +453,37 @@ usbMsgLen_t usbFunctionSetup(uint8_t data[8])
 			protocol_version = rq->wValue.bytes[1];
 			return 0; // send nothing
 		case USBRQ_HID_GET_REPORT:
-			usbMsgPtr = (uint8_t*)&keyboard_report; // send the report data
-			report_pending = 0;
-			keyboard_report_reset();
-			// determine the return data length based on which report ID was requested
-			if (rq->wValue.bytes[0] == 1) return 8;
-			if (rq->wValue.bytes[0] == 2) return 3;
-			if (rq->wValue.bytes[0] == 3) return 2;
-			if (rq->wValue.bytes[0] == 4) return 4;
-			return 8; // default
+			#ifdef ENABLE_VENDOR_CONFIG
+			if (rq->wValue.bytes[1] == 3 && rq->wValue.bytes[0] == VCFG_REPORT_ID) // feature report
+			{
+				usbMsgPtr = vcfg_report(); // the result of the last command, reading it changes nothing
+				return VCFG_REPORT_LEN;
+			}
+			#endif
+			// the current state of the requested report, reading it changes nothing
+			if (rq->wValue.bytes[0] > REPORT_ID_MAX || report_state(rq->wValue.bytes[0]) == 0) {
+				usbMsgPtr = (uint8_t*)&keyboard_report; // default
+				return sizeof(keyboard_report_t);
+			}
+			usbMsgPtr = report_state(rq->wValue.bytes[0]);
+			return report_size(rq->wValue.bytes[0]);
 		case USBRQ_HID_SET_REPORT:
+			#ifdef ENABLE_VENDOR_CONFIG
+			usb_write_vcfg = 0;
+			if (rq->wValue.bytes[1] == 3 && rq->wValue.bytes[0] == VCFG_REPORT_ID) // feature report
+			{
+				if (rq->wLength.word == VCFG_REPORT_LEN && vcfg_write_start())
+				{
+					usb_write_vcfg = 1;
+					return USB_NO_MSG; // send nothing but call usbFunctionWrite
+				}
+				return 0; // wrong size or busy, V-USB still takes the data but it is dropped, the host sees the old result
+			}
+			#endif
 			if (rq->wLength.word == 1) // check data is available
 			{
-				// 1 byte, we don't check report type (it can only be output or feature)
-				// we never implemented "feature" reports so it can't be feature
-				// so assume "output" reports
+				// 1 byte, the only other report the host can send is the "output" report
 				// this means set LED status
-				// since it's the only one in the descriptor
 				return USB_NO_MSG; // send nothing but call usbFunctionWrite
 			}
 			else // no data or do not understand data, ignore
@@ -229,6 +498,11 @@ usbMsgLen_t usbFunctionSetup(uint8_t data[8])
 // see http://vusb.wikidot.com/driver-api
 usbMsgLen_t usbFunctionWrite(uint8_t * data, uchar len)
 {
+	#ifdef ENABLE_VENDOR_CONFIG
+	if (usb_write_vcfg) {
+		return vcfg_write(data, len); // 1 once the whole report is in
+	}
+	#endif
 	LED_state = data[0];
 	return 1; // 1 byte read
 }
@@ -238,8 +512,10 @@ int main()
 {
 	wdt_disable(); // disable watchdog, good habit if you don't use it
 	
+	settings_init(); // find the latest value of every setting
+
 	#if defined(__AVR_ATtiny85__) || defined(__AVR_ATtiny45__) || defined(__AVR_ATtiny25__)
-	uint8_t calibrationValue = eeprom_read_byte(OSCCAL_EEADDR); /* calibration value from last time */
+	uint8_t calibrationValue = settings_get(SETTING_OSCCAL); /* calibration value from last time */
 	if (calibrationValue != 0xFF)
 	{
 		OSCCAL = calibrationValue;
@@ -247,9 +523,18 @@ int main()
 	#endif
 	
 	stdout = &mystdout; // set default stream
+
+	uint8_t keymap_state = usr_keymap_init(); // check and load the learned codes
+	#ifdef ENABLE_FLASH_KEYMAP
+	flashmap_init(); // check the keymap in flash
+	#endif
 	
 	TCCR0B = 0x05; // start timer0, used for measuring pulse widths
-	TCCR1 = 0x0F; // start timer1, used for key release timeout
+	// start timer1 as a millisecond clock (see ms_get), used for key release timeout and the idle rate
+	OCR1A = TMR1_TOP;
+	OCR1C = TMR1_TOP; // clears the counter on match
+	TCCR1 = _BV(CTC1) | TMR1_CLK_DIV_128;
+	TIMSK |= _BV(OCIE1A);
 
 	// input with pull up
 	JMP_DDRx  &= ~JMP_PINMASK;
@@ -261,8 +546,8 @@ int main()
 
 	if (! buttonPressed())  tryProgram = 0;  // dont bother trying to check the programming button
 
-	// initialize report (I never assume it's initialized to 0 automatically)
-	keyboard_report_reset();
+	// initialize reports (I never assume it's initialized to 0 automatically)
+	report_init();
 	
 	// enforce USB re-enumeration by pretending to disconnect and reconnect
 	usbDeviceDisconnect();
@@ -277,15 +562,24 @@ int main()
 	// initialize various modules
 	usbInit();
 
+	keymap_init();
+	#ifdef ENABLE_LAYOUT_SELECT
+	layout_init();
+	#endif
+
+	if (keymap_state == KEYMAP_CORRUPT)
+	{
+		// the learned codes were lost (unplugged while saving?), only the defaults work now
+		led_fault_blink();
+		if (! buttonPressed())  tryProgram = 0;  // dont bother trying to check the programming button
+	}
+
 	#ifdef ENABLE_MMKEY_TRANSLATE
-	if (eeprom_read_byte(MMKEY_TRANSLATE_EEADDR) != 0xFF) {
-		// flash LED to indicate we are in MMKEY translate mode
-		LED_PORTx &= ~LED_PINMASK; // LED off
-		usb_polling_delay_ms(200);
+	uint8_t m = mmkey_init();
+	if (m != 0) {
+		// flash LED once more for every mode step to indicate we are in MMKEY translate mode
+		led_blink(m);
 		if (! buttonPressed())  tryProgram = 0;  // dont bother trying to check the programming button
-		LED_PORTx |=  LED_PINMASK; // LED on
-		usb_polling_delay_ms(200);
-		LED_PORTx &= ~LED_PINMASK; // LED off
 	}
 	#endif
 
@@ -324,34 +618,98 @@ int main()
 	if (toProg >= 2000) {
 	  while (buttonPressed()) 
 	    usbPoll(); // wait for release
+	  #ifdef ENABLE_FAST_LEARN
+	  usr_prog_fast();
+	  #else
 	  usr_prog();
+	  #endif
 	}
 	LED_PORTx &= ~LED_PINMASK; // LED off
 
+	#ifdef ENABLE_ADDR_FILTER
+	// built after programming mode so that newly learned remotes are included, and so programming mode can learn any remote
+	addr_filter_init();
+	#endif
+
 	while (1) // main loop, do forever
 	{
 		// perform usb related background tasks
 		usbPollWrapper(); // this needs to be called at least once every 10 ms
-		// this is also called in send_report_once
+		// this is also called while waiting for room in the report FIFO
+
+		#ifdef ENABLE_VENDOR_CONFIG
+		vcfg_task(); // carry out configuration commands from the host
+		#endif
+
+		typematic_task(); // repeat the held key when it is time
 
 		ircap_res_t r = ir_cap(&ir_code);
 
 		if (r == IRCAP_NEWKEY)
 		{
+			tm_active = 0; // a new button, the old one is not repeated anymore
+			#ifdef ENABLE_MOUSE
+			pointer_dx = 0;
+			pointer_dy = 0;
+			#endif
 			last_keycode = ir_to_kb(ir_code);
+			ir_stat_inc(frames);
 			#ifdef ENABLE_FULL_DEBUG
 			printf_P(PSTR(" C: 0x%04X%04X K: 0x%04X%04X "),
 			(unsigned int)((ir_code & 0xFFFF0000) >> 16), (unsigned int)(ir_code & 0xFFFF),
 			(unsigned int)(last_keycode >> 16), (unsigned int)(last_keycode & 0xFFFF)); // split into 16 bit chunks due to suspected stdio bug
 			#endif
-			if (last_keycode != 0)
+			if ((last_keycode & 0xFF) == KEYCODE_FN_REPORT_ID)
+			{
+				// handled here, nothing is sent
+				uint8_t n = keymap_fn(last_keycode);
+				if (n != 0) {
+					led_blink(n);
+				}
+			}
+			else if (last_keycode != 0)
 			{
-				*((uint32_t*)&keyboard_report) = last_keycode;
-				report_pending = 1;
+				uint8_t tm = keymap_typematic(&last_keycode, &tm_class); // before anything looks at the report ID
+				#ifdef ENABLE_MOUSE
+				last_keycode = pointer_translate(last_keycode);
+				#endif
+				uint8_t id = last_keycode & 0xFF;
+				if (id == KEYCODE_CHORD_REPORT_ID) {
+					id = 1; // chords are keyboard reports
+				}
+				if (report_down_id != 0 && report_down_id != id)
+				{
+					// the remote can only hold one button, so the key of the other report is let go
+					report_clear(report_down_id);
+					report_queue(report_down_id);
+					report_down_id = 0;
+				}
+				#ifdef ENABLE_MOUSE
+				if (pointer_move(last_keycode)) {
+					// moved by pointer_task until the button is let go of
+				}
+				else
+				#endif
+				if (report_set_kc(last_keycode))
+				{
+					report_queue(id);
+					report_down_id = id;
+					if (tm != TYPEMATIC_HOLD)
+					{
+						// let go of it right away, held buttons are repeated here instead of by the host
+						report_tap(id);
+						report_down_id = 0;
+						tm_kc = last_keycode;
+						tm_next_ms = ms_get() + tm_class.delay;
+						tm_cnt = 0;
+						tm_active = (tm_class.delay != 0);
+					}
+				}
 				LED_PORTx |= LED_PINMASK; // LED on
 			}
 			else
 			{
+				ir_stat_inc(unknown);
 				#ifdef ENABLE_UNKNOWN_DEBUG
 				// if we get a code that is known, type it out to the screen so the user can see it and maybe reprogram the command table with it later
 				printf_P(PSTR(" UK: 0x%04X%04X %d "), (unsigned int)((ir_code & 0xFFFF0000) >> 16), (unsigned int)(ir_code & 0xFFFF), bit_idx); // split into 16 bit chunks due to suspected stdio bug
@@ -365,36 +723,29 @@ int main()
 		}
 		else if (r == IRCAP_REPEATKEY)
 		{
-			if (last_keycode > 0
-			&& last_keycode != KEYCODE_MUTE && last_keycode != KEYCODE_PLAYPAUSE // do not repeat these keys
-			)
-			{
-				*((uint32_t*)&keyboard_report) = last_keycode;
-				report_pending = 2;
-			}
+			ir_stat_inc(repeats);
+			// a held key is not sent again, either the host repeats it or typematic_task does
 		}
 
-		if (r != IRCAP_NOTHING)
-		{
-			TCNT1 = 0;
-			if (bit_is_set(TIFR, TOV1)) TIFR |= _BV(TOV1);
-		}
-
-		if (TCNT1 >= TMR1_TIMEOUT_120MS || bit_is_set(TIFR, TOV1) || r == IRCAP_ERROR)
+		// the next frame should have started by now, it would keep ir_cap busy if it did (see ir_frame_ms)
+		if (ir_active && ((uint16_t)(ms_get() - ir_frame_ms) >= ir_period_ms + KEY_RELEASE_MARGIN_MS || r == IRCAP_ERROR))
 		{
+			ir_active = 0;
+			tm_active = 0;
+			#ifdef ENABLE_MOUSE
+			pointer_dx = 0;
+			pointer_dy = 0;
+			#endif
 			last_keycode = 0; // too long for repeat signal, invalidate this to reject noise
+			keymap_release();
 
-			if (report_pending != 4)
+			if (report_down_id != 0)
 			{
-				keyboard_report_reset();
-				report_pending = 3;
-				// this will send a blank keystroke only once
+				report_clear(report_down_id); // only once, the other reports are left alone
+				report_queue(report_down_id);
+				report_down_id = 0;
 			}
 
-			// prevent the timer from actually overflowing but also keeps the timed-out state
-			TCNT1 = TMR1_TIMEOUT_120MS;
-			if (bit_is_set(TIFR, TOV1)) TIFR |= _BV(TOV1);
-
 			LED_PORTx &= ~LED_PINMASK; // LED off
 		}
 
@@ -411,29 +762,10 @@ int main()
 		{
 			if (toProg > 1000)
 			{
-				// toggle between MMKEY translate modes
-				if (eeprom_read_byte(MMKEY_TRANSLATE_EEADDR) == 0xFF) {
-					eeprom_write_byte(MMKEY_TRANSLATE_EEADDR, 0x00);
-					// flash LED to indicate new mode
-					LED_PORTx &= ~LED_PINMASK; // LED off
-					usb_polling_delay_ms(200);
-					LED_PORTx |=  LED_PINMASK; // LED on
-					usb_polling_delay_ms(200);
-					LED_PORTx &= ~LED_PINMASK; // LED off
-					usb_polling_delay_ms(200);
-					LED_PORTx |=  LED_PINMASK; // LED on
-					usb_polling_delay_ms(200);
-					LED_PORTx &= ~LED_PINMASK; // LED off
-				}
-				else {
-					eeprom_write_byte(MMKEY_TRANSLATE_EEADDR, 0xFF);
-					// flash LED to indicate new mode
-					LED_PORTx &= ~LED_PINMASK; // LED off
-					usb_polling_delay_ms(200);
-					LED_PORTx |=  LED_PINMASK; // LED on
-					usb_polling_delay_ms(200);
-					LED_PORTx &= ~LED_PINMASK; // LED off
-				}
+				// cycle through the MMKEY translate modes, wrapping back around to no translation
+				uint8_t m = mmkey_next();
+				// flash LED to indicate new mode, one blink for no translation, two for the first mode, etc
+				led_blink(m + 1);
 				while (bit_is_clear(JMP_PINx, JMP_PINNUM)) usbPoll(); // wait for release
 			}
 
@@ -477,19 +809,38 @@ ircap_res_t ir_cap(uint32_t* ir_code_ptr)
 		if (tmpTCNT0 >= PULSEWIDTH_INITIAL_9MS && tmpTCNT0 <= (PULSEWIDTH_INITIAL_9MS + PULSEWIDTH_2MS))
 		{
 			bit_idx = -2; // reset bit index since it is the initial pulse
+
+			// the frame started when this pulse did, the release deadline counts from here
+			uint16_t t = ms_get() - NEC_LEADER_MS;
+			uint16_t d = t - ir_frame_ms;
+			#ifdef ENABLE_ADDR_FILTER
+			ir_prev_frame_ms = ir_frame_ms;
+			ir_prev_period_ms = ir_period_ms;
+			ir_prev_active = ir_active;
+			#endif
+			if (ir_active && d >= NEC_PERIOD_MIN_MS && d <= NEC_PERIOD_MAX_MS) {
+				ir_period_ms = d; // a button is held, this is the time from one of its frames to the next
+			}
+			ir_frame_ms = t;
+			ir_active = 1;
 			#ifdef ENABLE_TIMEBUFF_DEBUG
 			time_buff_idx = 0;
 			#endif
 		}
 		else if (tmpTCNT0 >= PULSEWIDTH_ON_MIN && tmpTCNT0 <= (PULSEWIDTH_INITIAL_9MS / 8))
 		{
-			bit_idx++; // this becomes 0 if it was -1 before (when the off pulse is valid)
+			if (bit_idx != INDICATE_FOREIGN) {
+				bit_idx++; // this becomes 0 if it was -1 before (when the off pulse is valid)
+			}
 		}
 		else
 		{
 			#ifdef ENABLE_UNKNOWN_DEBUG
 			printf_P(PSTR(" e1 %d %d "), bit_idx, tmpTCNT0);
 			#endif
+			if (bit_idx != INDICATE_ERROR) {
+				ir_stat_inc(errors); // once per bad frame, ir_cap keeps returning IRCAP_ERROR until the next initial pulse
+			}
 			bit_idx = INDICATE_ERROR;
 		}
 
@@ -525,21 +876,49 @@ ircap_res_t ir_cap(uint32_t* ir_code_ptr)
 			else {
 				(*ir_code_ptr) |=  (1UL << bit_idx);
 			}
+
+			#ifdef ENABLE_ADDR_FILTER
+			// NEC sends the address first, so once it is complete we can tell if the frame could possibly be for us
+			if (bit_idx == 15 && addr_filter_on && addr_filter_check(*ir_code_ptr) == 0)
+			{
+				bit_idx = INDICATE_FOREIGN;
+				ir_foreign = 1;
+				ir_stat_inc(foreign);
+				ir_timing_restore();
+				res = IRCAP_NOTHING;
+			}
+			#endif
 		}
 		else if (tmpTCNT0 >= PULSEWIDTH_3MS && bit_idx > 0)
 		{
 			// new command
 			res = IRCAP_NEWKEY;
+			#ifdef ENABLE_ADDR_FILTER
+			ir_foreign = 0;
+			#endif
 		}
 		else if (bit_idx == -2 && tmpTCNT0 >= PULSEWIDTH_2MS && tmpTCNT0 <= PULSEWIDTH_3MS)
 		{
 			bit_idx = -5; // signal that repeat key is possible
+			#ifdef ENABLE_ADDR_FILTER
+			if (ir_foreign)
+			{
+				// repeating a frame that was dropped, the held key is not kept held by it
+				ir_timing_restore();
+				res = IRCAP_NOTHING;
+			}
+			#endif
 		}
 		else if (tmpTCNT0 >= PULSEWIDTH_3MS && bit_idx == -4)
 		{
 			// repeated command
 			res = IRCAP_REPEATKEY;
 			bit_idx++;
+			#ifdef ENABLE_ADDR_FILTER
+			if (ir_foreign) {
+				res = IRCAP_NOTHING; // repeating a frame that was dropped
+			}
+			#endif
 		}
 		else if (bit_idx == -2 && tmpTCNT0 >= PULSEWIDTH_4MS && tmpTCNT0 <= PULSEWIDTH_5MS)
 		{
@@ -547,11 +926,21 @@ ircap_res_t ir_cap(uint32_t* ir_code_ptr)
 			bit_idx = -1;
 			last_keycode = 0;
 		}
+		#ifdef ENABLE_ADDR_FILTER
+		else if (bit_idx == INDICATE_FOREIGN)
+		{
+			// remainder of a dropped frame, wait for the next initial pulse
+			res = IRCAP_NOTHING;
+		}
+		#endif
 		else
 		{
 			#ifdef ENABLE_UNKNOWN_DEBUG
 			printf_P(PSTR(" e2 %d %d "), bit_idx, tmpTCNT0);
 			#endif
+			if (bit_idx != INDICATE_ERROR) {
+				ir_stat_inc(errors);
+			}
 			bit_idx = INDICATE_ERROR;
 		}
 	}
@@ -564,300 +953,506 @@ ircap_res_t ir_cap(uint32_t* ir_code_ptr)
 	return res;
 }
 
-uint32_t mmkey_translate(uint32_t kc) {
-#ifdef ENABLE_MMKEY_TRANSLATE
-  if (eeprom_read_byte(MMKEY_TRANSLATE_EEADDR) != 0xFF) {
-    switch (kc)
-      {
-      case KEYCODE_EQUAL:
-      case KEYCODE_ARROW_UP:
-	return KEYCODE_VOL_UP;
-      case KEYCODE_MINUS:
-      case KEYCODE_ARROW_DOWN:
-	return KEYCODE_VOL_DOWN;
-      case KEYCODE_ARROW_RIGHT:
-	return KEYCODE_SCAN_NEXT_TRACK;
-      case KEYCODE_ARROW_LEFT:
-	return KEYCODE_SCAN_PREV_TRACK;
-      case KEYCODE_X:
-	return KEYCODE_STOP;
-      case KEYCODE_SPACE:
-	return KEYCODE_PLAYPAUSE;
-      case KEYCODE_ESC:
-	return KEYCODE_KB_MENU;
-	/*
-	  case KEYCODE_APP:
-	  return XBMC_CONTEXTUALMENU;
-	  case KEYCODE_SYS_POWER:
-	  case KEYCODE_SYS_SLEEP:
-	  return XBMC_SHUTDOWNMENU;
-	  case KEYCODE_MUTE:
-	  return kc;
-	*/
-      }
-  }
+#ifdef ENABLE_ADDR_FILTER
+// undoes what the leading pulse of a dropped frame did to the release timing, so another remote cannot keep a key held
+static void ir_timing_restore()
+{
+	ir_frame_ms = ir_prev_frame_ms;
+	ir_period_ms = ir_prev_period_ms;
+	ir_active = ir_prev_active;
+}
+
+// adds a remote to the address filter, codes from addresses that are not in the filter are dropped by ir_cap
+// if there are too many remotes then addr_filter_init turns the filter off
+void addr_filter_add(uint16_t addr, uint16_t mask)
+{
+	if (addr_filter_cnt > ADDR_FILTER_SIZE) {
+		return; // already overflowed
+	}
+	for (uint8_t i = 0; i < addr_filter_cnt; i++)
+	{
+		if (addr_filter[i][0] == addr && addr_filter[i][1] == mask) {
+			return; // already have it
+		}
+	}
+	if (addr_filter_cnt < ADDR_FILTER_SIZE) {
+		addr_filter[addr_filter_cnt][0] = addr;
+		addr_filter[addr_filter_cnt][1] = mask;
+	}
+	addr_filter_cnt++;
+}
+
+// builds the address filter out of every keymap layer
+void addr_filter_init()
+{
+	addr_filter_cnt = 0;
+	keymap_addr_filter_add();
+	addr_filter_on = (addr_filter_cnt != 0 && addr_filter_cnt <= ADDR_FILTER_SIZE);
+}
+
+// returns non-zero if the address of the IR code is in the filter
+static char addr_filter_check(uint32_t ircode)
+{
+	uint16_t addr = ircode & 0xFFFF;
+	for (uint8_t i = 0; i < addr_filter_cnt; i++)
+	{
+		if (((addr ^ addr_filter[i][0]) & addr_filter[i][1]) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
 #endif
 
-  return kc;
+#define report_fifo_idx(i) (((i) >= REPORT_FIFO_SIZE) ? ((i) - REPORT_FIFO_SIZE) : (i))
+
+// writes the report ID into each report and releases everything
+static void report_init()
+{
+	for (uint8_t id = 1; id <= REPORT_ID_MAX; id++)
+	{
+		uint8_t* st = report_state(id);
+		if (st != 0) {
+			st[0] = id;
+			report_clear(id);
+		}
+		// the recommended defaults, 500 ms for keyboards and only on change for the rest
+		idle_rate[id] = (id == 1) ? (500 / 4) : 0;
+	}
+	idle_rate[0] = 500 / 4;
 }
 
-// this function does a search of the IR-button command pair table for the IR code, returning the corresponding keycode
-// or 0 if not found or error
-uint32_t ir_to_kb(uint32_t ircode)
+// releases everything in one report, nothing is sent until it is queued or marked
+static void report_clear(uint8_t id)
 {
-	uint32_t r = usr_ir_to_kb(ircode);
+	uint8_t* st = report_state(id);
+	if (st != 0) {
+		memset(&st[1], 0, report_size(id) - 1);
+	}
+}
+
+// sets the report that a keycode belongs to, see kbrd_codes.h for the layout
+// returns 0 if the report ID is not in the report descriptor
+static char report_set_kc(uint32_t kc)
+{
+	uint8_t id = kc & 0xFF;
+	if (id == KEYCODE_CHORD_REPORT_ID)
+	{
+		// every key of the chord in one keyboard report
+		keymap_chord_t c;
+		if (keymap_chord(kc >> 24, &c) == 0) {
+			return 0;
+		}
+		report_clear(1);
+		report_kb_press(&keyboard_report, c.modifier, 0);
+		for (uint8_t i = 0; i < sizeof(c.keycode); i++) {
+			report_kb_press(&keyboard_report, 0, c.keycode[i]);
+		}
+		return 1;
+	}
+	uint8_t* st = (id <= REPORT_ID_MAX) ? report_state(id) : 0;
+	if (st == 0) {
+		return 0;
+	}
+	report_clear(id);
+	for (uint8_t i = 1; i < report_size(id) && i < sizeof(uint32_t); i++) {
+		st[i] = kc >> (i * 8);
+	}
+	return 1;
+}
 
+// adds a key and modifiers to the keys already held in a keyboard report, nothing is sent until it is queued or marked
+// a key that is already held stays where it is, returns 0 if all the key slots are in use
+static char report_kb_press(keyboard_report_t* r, uint8_t mod, uint8_t key)
+{
+	r->modifier |= mod;
+	if (key == 0) {
+		return 1;
+	}
+	for (uint8_t i = 0; i < sizeof(r->keycode); i++)
+	{
+		// the held keys are always at the start, so the first empty slot ends them
+		if (r->keycode[i] == key) {
+			return 1;
+		}
+		if (r->keycode[i] == 0) {
+			r->keycode[i] = key;
+			return 1;
+		}
+	}
+	return 0;
+}
 
-	#ifdef ENABLE_DEFAULT_CODES
-	if (r == 0)
+// lets go of a key and modifiers in a keyboard report, the other keys stay held
+// type_char uses it on type_report, the remote lets go of everything at once with report_clear
+static void report_kb_release(keyboard_report_t* r, uint8_t mod, uint8_t key)
+{
+	r->modifier &= ~mod;
+	if (key == 0) {
+		return;
+	}
+	for (uint8_t i = 0; i < sizeof(r->keycode); i++)
 	{
-		// search through table of IR-button command pairs
-		for (int i = 0; ; i++)
+		if (r->keycode[i] == key)
 		{
-			usbPoll();
-			uint32_t tblVal = pgm_read_dword(&((uint32_t*)ir_but_tbl)[i * 2]);
-			if (tblVal == 0 || tblVal == 0xFFFFFFFF) {
-				// null termination found or flash is empty
-				break;
-			}
-			if (tblVal == ircode)
-			{
-			  return mmkey_translate(pgm_read_dword(&((uint32_t*)ir_but_tbl)[i * 2 + 1])); // found, return the key
+			// move the keys after it down, so the empty slots stay at the end
+			for (; i < sizeof(r->keycode) - 1; i++) {
+				r->keycode[i] = r->keycode[i + 1];
 			}
+			r->keycode[i] = 0;
+			return;
 		}
 	}
-	#endif
+}
 
-	#ifdef ENABLE_APPLE_DEFAULTS
-	if (r == 0)
+// adds a copy of a report to the end of the FIFO, waits (servicing USB) only if the FIFO is full
+// every queued copy is sent exactly once and in order, so quick key presses and typed text are never lost or merged
+static void report_queue(uint8_t id)
+{
+	report_fifo_t* f = report_fifo_of(id);
+	while (f->cnt == REPORT_FIFO_SIZE) {
+		usbPollWrapper();
+	}
+	keyboard_report_t* r = &f->buf[f->head];
+	memcpy(r, report_state(id), report_size(id));
+	if (id == 1)
 	{
-		r = apple_code_check(ircode);
+		// the typed keys are only in the copy, so typing never changes the keys held from the remote
+		r->modifier |= type_report.modifier;
+		for (uint8_t i = 0; i < sizeof(type_report.keycode) && type_report.keycode[i] != 0; i++) {
+			report_kb_press(r, 0, type_report.keycode[i]);
+		}
 	}
-	#endif
+	f->head = report_fifo_idx(f->head + 1);
+	f->cnt++;
+	report_dirty &= ~_BV(id); // the copy has the latest state
+}
 
+// asks for a report to be sent when nothing is queued, marking it again before that only sends it once
+// for state that only matters as it is now, not every step along the way
+static void report_mark(uint8_t id)
+{
+	if (id != 0) {
+		report_dirty |= _BV(id);
+	}
+}
 
-	r = mmkey_translate(r);
+// lets go of the key of a report that was just queued, so the host sees one key press
+static void report_tap(uint8_t id)
+{
+	report_clear(id);
+	report_queue(id);
+}
 
-	return r; // not found
+// takes the next report for an endpoint, the oldest in its FIFO or else a marked one (ids has a bit for each report ID it sends)
+// returns 0 if there is nothing to send
+static uint8_t* report_next(report_fifo_t* f, uint8_t ids)
+{
+	uint8_t d = report_dirty & ids;
+	if (f->cnt == 0 && d != 0)
+	{
+		// a marked report goes through the FIFO as well, so it gets the typed keys too
+		uint8_t id = 1;
+		while (bit_is_clear(d, id)) id++;
+		report_queue(id); // never waits, the FIFO is empty
+	}
+	if (f->cnt != 0)
+	{
+		uint8_t* r = (uint8_t*)&f->buf[report_fifo_idx(f->head + REPORT_FIFO_SIZE - f->cnt)];
+		f->cnt--;
+		return r;
+	}
+	return 0;
 }
 
 // a wrapper for usbPoll, which must be called often
-// sends new report when needed
+// sends the oldest report in the FIFO whenever the interrupt-IN endpoint is free, then any marked report
 void usbPollWrapper()
 {
-	if (usbInterruptIsReady() && report_pending != 0 && report_pending != 4)
+	uint8_t* r;
+	if (type_buf_cnt != 0 && report_fifo.cnt <= REPORT_FIFO_SIZE - TYPE_CHAR_REPORTS)
 	{
-		uint8_t s = 8;
-		if (keyboard_report.report_id == 2) s = 3;
-		if (keyboard_report.report_id == 3) s = 2;
-		if (keyboard_report.report_id == 4) s = 4;
-		usbSetInterrupt((uint8_t*)(&keyboard_report), s);
-
-		if (report_pending == 3) {
-			// only once
-			report_pending = 4;
-		}
-		else {
-			report_pending = 0;
+		// so type_char will not have to wait for room
+		// one character per call is plenty, the FIFO only empties one report per 10 ms
+		uint8_t c = type_buf[(type_buf_head >= type_buf_cnt) ? (type_buf_head - type_buf_cnt) : (type_buf_head + TYPE_BUF_SIZE - type_buf_cnt)];
+		type_buf_cnt--;
+		type_char(c);
+	}
+	if (type_held && report_fifo.cnt == 0 && type_buf_cnt == 0)
+	{
+		// the typed out text was sent, let go of its keys before the host starts repeating the last one
+		type_held = 0;
+		memset(&type_report, 0, sizeof(keyboard_report_t));
+		report_mark(1); // the keys held from the remote stay down
+	}
+	uint16_t ms = ms_get();
+	for (uint8_t id = 1; id <= REPORT_ID_MAX; id++)
+	{
+		// an unchanged report is sent again once every idle period, never if the idle rate is 0
+		if (idle_rate[id] != 0 && report_state(id) != 0 && (uint16_t)(ms - report_ms[id]) >= idle_rate[id] * 4) {
+			report_mark(id);
 		}
 	}
+	if (usbInterruptIsReady() && (r = report_next(&report_fifo, REPORT_EP1_IDS)) != 0) {
+		usbSetInterrupt(r, report_size(r[0])); // copies the data, so the entry can be reused right away
+		report_ms[r[0]] = ms;
+	}
+	#ifdef ENABLE_MOUSE
+	pointer_task();
+	#endif
+	#ifdef ENABLE_SECOND_ENDPOINT
+	if (usbInterruptIsReady3() && (r = report_next(&report_fifo3, ~REPORT_EP1_IDS)) != 0) {
+		usbSetInterrupt3(r, report_size(r[0]));
+		report_ms[r[0]] = ms;
+	}
+	#endif
 
 	usbPoll();
+
+	if (osccal_dirty) {
+		osccal_dirty = 0;
+		settings_set(SETTING_OSCCAL, OSCCAL); // store the calibrated value in EEPROM
+	}
+	eeq_poll(); // write the next queued EEPROM byte if the EEPROM is idle
 }
 
-// translates ASCII to appropriate keyboard report, taking into consideration the status of caps lock
-void ASCII_to_keycode(uint8_t ascii)
+// presses the held key again when its next repeat is due, see TYPEMATIC_CLASS_TBL
+// the repeats come from the millisecond clock, not the IR frames, so they can be faster than the remote sends them
+static void typematic_task()
 {
-	keyboard_report.report_id = 1;
-	keyboard_report.keycode[0] = 0x00;
-	keyboard_report.modifier = 0x00;
-	
-	// see scancode.doc appendix C
-	
-	if (ascii >= 'A' && ascii <= 'Z')
+	if (tm_active == 0 || (int16_t)(ms_get() - tm_next_ms) < 0) {
+		return;
+	}
+	if (tm_cnt < tm_class.accel_cnt) {
+		tm_cnt++;
+	}
+	tm_next_ms = ms_get() + ((tm_class.accel_cnt != 0 && tm_cnt >= tm_class.accel_cnt) ? tm_class.accel_rate : tm_class.rate);
+
+	uint8_t id = tm_kc & 0xFF;
+	if (id == KEYCODE_CHORD_REPORT_ID) {
+		id = 1;
+	}
+	if (report_set_kc(tm_kc))
 	{
-		keyboard_report.keycode[0] = 4 + ascii - 'A'; // set letter
-		if (bit_is_set(LED_state, 1)) // if caps is on
-		{
-			keyboard_report.modifier = 0x00; // no shift
-		}
-		else
-		{
-			keyboard_report.modifier = _BV(1); // hold shift // hold shift
-		}
+		report_queue(id);
+		report_tap(id);
 	}
-	else if (ascii >= 'a' && ascii <= 'z')
+}
+
+#ifdef ENABLE_MOUSE
+// turns pointer mode on or off, returns 1 if it is on now
+char pointer_toggle()
+{
+	pointer_on = !pointer_on;
+	pointer_dx = 0;
+	pointer_dy = 0;
+	return pointer_on;
+}
+
+// in pointer mode, the keys that stand for the mouse instead
+static uint32_t pointer_translate(uint32_t kc)
+{
+	if (pointer_on == 0) {
+		return kc;
+	}
+	switch (kc)
 	{
-		keyboard_report.keycode[0] = 4 + ascii - 'a'; // set letter
-		if (bit_is_set(LED_state, 1)) // if caps is on
-		{
-			keyboard_report.modifier = _BV(1); // hold shift // hold shift
-		}
-		else
-		{
-			keyboard_report.modifier = 0x00; // no shift
-		}
+		case KEYCODE_ARROW_UP:		return MOUSECODE_UP;
+		case KEYCODE_ARROW_DOWN:	return MOUSECODE_DOWN;
+		case KEYCODE_ARROW_LEFT:	return MOUSECODE_LEFT;
+		case KEYCODE_ARROW_RIGHT:	return MOUSECODE_RIGHT;
+		case KEYCODE_ENTER:			return MOUSECODE_BUT_LEFT;
+		case KEYCODE_BACKSPACE:		return MOUSECODE_BUT_RIGHT;
+		default:					return kc;
+	}
+}
+
+// starts moving the pointer for a mouse motion code, returns 0 for any other keycode (mouse buttons are held like keys)
+static char pointer_move(uint32_t kc)
+{
+	int8_t dx = kc >> 16;
+	int8_t dy = kc >> 24;
+	if ((kc & 0xFF) != 4 || (dx == 0 && dy == 0)) {
+		return 0;
+	}
+	pointer_dx = (dx > 0) - (dx < 0); // only the direction is used
+	pointer_dy = (dy > 0) - (dy < 0);
+	pointer_start_ms = ms_get();
+	pointer_last_ms = pointer_start_ms - POINTER_FRAME_MS; // the first step goes out right away
+	return 1;
+}
+
+// queues a motion report every frame while a motion button is held, called from usbPollWrapper
+// so the pointer keeps moving smoothly while ir_cap waits for IR pulses
+static void pointer_task()
+{
+	if (pointer_dx == 0 && pointer_dy == 0) {
+		return;
+	}
+	uint16_t ms = ms_get();
+	if ((uint16_t)(ms - pointer_last_ms) < POINTER_FRAME_MS || report_fifo_of(4)->cnt != 0) {
+		return; // never more than one step waiting, so the pointer stops as soon as the button is let go of
+	}
+	pointer_last_ms = ms;
+
+	uint16_t v = (uint16_t)(ms - pointer_start_ms) / POINTER_ACCEL_MS + POINTER_SPEED_MIN;
+	if (v > POINTER_SPEED_MAX) {
+		v = POINTER_SPEED_MAX;
+	}
+	mouse_report[2] = pointer_dx * (int8_t)v;
+	mouse_report[3] = pointer_dy * (int8_t)v;
+	report_queue(4);
+	// the motion is relative, so it is only in this one report, the idle rate resends the buttons only
+	mouse_report[2] = 0;
+	mouse_report[3] = 0;
+}
+#endif
+
+#ifdef ENABLE_LAYOUT_SELECT
+#define LAYOUT_TBL_ENTRY(id) LAYOUT_TBL_##id,
+#define LAYOUT_DEAD_ENTRY(id) LAYOUT_DEAD_##id,
+const PROGMEM uint8_t layout_tbl[LAYOUT_CNT][LAYOUT_TBL_SIZE] = { LAYOUT_LIST(LAYOUT_TBL_ENTRY) };
+const PROGMEM char layout_dead[LAYOUT_CNT][4] = { LAYOUT_LIST(LAYOUT_DEAD_ENTRY) };
+static uint8_t layout_idx = LAYOUT_IDX(KEYBOARD_LAYOUT);
+
+// selects the saved host keyboard layout, must be called once at start-up after settings_init
+void layout_init()
+{
+	layout_idx = settings_get(SETTING_LAYOUT);
+	if (layout_idx >= LAYOUT_CNT) {
+		layout_idx = LAYOUT_IDX(KEYBOARD_LAYOUT); // never saved
+	}
+}
+
+// selects a host keyboard layout and saves it, a layout that does not exist selects the one picked at build time
+void layout_set(uint8_t idx)
+{
+	if (idx >= LAYOUT_CNT) idx = LAYOUT_IDX(KEYBOARD_LAYOUT);
+	layout_idx = idx;
+	settings_set(SETTING_LAYOUT, idx); // only written when the layout actually changes
+}
+#else
+// only the layout picked at build time
+#define LAYOUT_TBL_(id) LAYOUT_TBL_##id
+#define LAYOUT_DEAD_(id) LAYOUT_DEAD_##id
+#define LAYOUT_TBL(id) LAYOUT_TBL_(id)
+#define LAYOUT_DEAD(id) LAYOUT_DEAD_(id)
+const PROGMEM uint8_t layout_tbl[1][LAYOUT_TBL_SIZE] = { LAYOUT_TBL(KEYBOARD_LAYOUT) };
+const PROGMEM char layout_dead[1][4] = { LAYOUT_DEAD(KEYBOARD_LAYOUT) };
+#define layout_idx 0
+#endif
+
+uint8_t layout_get()
+{
+	#ifdef ENABLE_LAYOUT_SELECT
+	return layout_idx;
+	#else
+	return LAYOUT_IDX(KEYBOARD_LAYOUT);
+	#endif
+}
+
+// translates ASCII to appropriate keyboard report for the host's layout (see layouts.h), taking into consideration the status of caps lock
+// one table lookup, returns 1 for a dead key, which has to be followed by a space
+char ASCII_to_keycode(uint8_t ascii, keyboard_report_t* rpt)
+{
+	rpt->report_id = 1;
+	rpt->modifier = 0x00;
+	memset(rpt->keycode, 0, sizeof(rpt->keycode));
+
+	if (ascii == '\n') {
+		rpt->keycode[0] = 0x28; // enter
+		return 0;
+	}
+	if (ascii == '\t') {
+		rpt->keycode[0] = 0x2B;
+		return 0;
+	}
+	if (ascii < 0x20 || ascii >= 0x80) {
+		return 0; // nothing to type
+	}
+
+	uint8_t e = pgm_read_byte(&layout_tbl[layout_idx][ascii - 0x20]);
+	rpt->keycode[0] = ((e & 0x3F) == LNUS) ? 0x64 : (e & 0x3F);
+	if (e & 0x40) {
+		rpt->modifier |= _BV(1); // hold shift
+	}
+	if (e & 0x80) {
+		rpt->modifier |= _BV(6); // hold AltGr
+	}
+	if ((ascii | 0x20) >= 'a' && (ascii | 0x20) <= 'z' && bit_is_set(LED_state, 1)) {
+		rpt->modifier ^= _BV(1); // caps is on, letters need the opposite shift
 	}
-	else if (ascii >= '0' && ascii <= '9')
+	return strchr_P(layout_dead[layout_idx], ascii) != NULL;
+}
+
+// stdio's stream will use this funct to type out characters in a string
+// the character is only put in type_buf, usbPollWrapper types it out when there is room in the report FIFO
+// so printf returns right away and IR capture keeps going, it only waits (servicing USB) if type_buf is full
+void type_out_char(uint8_t ascii, FILE * stream)
+{
+	while (type_buf_cnt == TYPE_BUF_SIZE) {
+		usbPollWrapper();
+	}
+	type_buf[type_buf_head] = ascii;
+	type_buf_head = (type_buf_head + 1 == TYPE_BUF_SIZE) ? 0 : (type_buf_head + 1);
+	type_buf_cnt++;
+}
+
+// queues the reports that type one character
+// usually one report per character: each key is added to the keys still held from the characters before it
+// a key only has to be let go of first when it is typed again while still held, or when every key slot is used
+// everything is let go of in usbPollWrapper once the FIFO is empty
+static void type_char(uint8_t ascii)
+{
+	keyboard_report_t c;
+	char dead = ASCII_to_keycode(ascii, &c);
+	uint8_t key = c.keycode[0];
+	if (key == 0) {
+		return; // nothing to type
+	}
+
+	for (uint8_t i = 0; i < sizeof(type_report.keycode); i++)
 	{
-		keyboard_report.modifier = 0x00;
-		if (ascii == '0')
-		{
-			keyboard_report.keycode[0] = 0x27;
-		}
-		else
+		if (type_report.keycode[i] == key)
 		{
-			keyboard_report.keycode[0] = 30 + ascii - '1'; 
+			// repeated character, the host only types it again if it sees the key go up and down
+			report_kb_release(&type_report, 0, key);
+			report_queue(1);
+			break;
 		}
 	}
-	else
-	{
-		switch (ascii) // convert ascii to keycode according to documentation
-		{
-			case '!':
-				keyboard_report.modifier = _BV(1); // hold shift
-				keyboard_report.keycode[0] = 29 + 1;
-				break;
-			case '@':
-				keyboard_report.modifier = _BV(1); // hold shift
-				keyboard_report.keycode[0] = 29 + 2;
-				break;
-			case '#':
-				keyboard_report.modifier = _BV(1); // hold shift
-				keyboard_report.keycode[0] = 29 + 3;
-				break;
-			case '$':
-				keyboard_report.modifier = _BV(1); // hold shift
-				keyboard_report.keycode[0] = 29 + 4;
-				break;
-			case '%':
-				keyboard_report.modifier = _BV(1); // hold shift
-				keyboard_report.keycode[0] = 29 + 5;
-				break;
-			case '^':
-				keyboard_report.modifier = _BV(1); // hold shift
-				keyboard_report.keycode[0] = 29 + 6;
-				break;
-			case '&':
-				keyboard_report.modifier = _BV(1); // hold shift
-				keyboard_report.keycode[0] = 29 + 7;
-				break;
-			case '*':
-				keyboard_report.modifier = _BV(1); // hold shift
-				keyboard_report.keycode[0] = 29 + 8;
-				break;
-			case '(':
-				keyboard_report.modifier = _BV(1); // hold shift
-				keyboard_report.keycode[0] = 29 + 9;
-				break;
-			case ')':
-				keyboard_report.modifier = _BV(1); // hold shift
-				keyboard_report.keycode[0] = 0x27;
-				break;
-			case '~':
-				keyboard_report.modifier = _BV(1); // hold shift
-				// fall through
-			case '`':
-				keyboard_report.keycode[0] = 0x35;
-				break;
-			case '_':
-				keyboard_report.modifier = _BV(1); // hold shift
-				// fall through
-			case '-':
-				keyboard_report.keycode[0] = 0x2D;
-				break;
-			case '+':
-				keyboard_report.modifier = _BV(1); // hold shift
-				// fall through
-			case '=':
-				keyboard_report.keycode[0] = 0x2E;
-				break;
-			case '{':
-				keyboard_report.modifier = _BV(1); // hold shift
-				// fall through
-			case '[':
-				keyboard_report.keycode[0] = 0x2F;
-				break;
-			case '}':
-				keyboard_report.modifier = _BV(1); // hold shift
-				// fall through
-			case ']':
-				keyboard_report.keycode[0] = 0x30;
-				break;
-			case '|':
-				keyboard_report.modifier = _BV(1); // hold shift
-				// fall through
-			case '\\':
-				keyboard_report.keycode[0] = 0x31;
-				break;
-			case ':':
-				keyboard_report.modifier = _BV(1); // hold shift
-				// fall through
-			case ';':
-				keyboard_report.keycode[0] = 0x33;
-				break;
-			case '"':
-				keyboard_report.modifier = _BV(1); // hold shift
-				// fall through
-			case '\'':
-				keyboard_report.keycode[0] = 0x34;
-				break;
-			case '<':
-				keyboard_report.modifier = _BV(1); // hold shift
-				// fall through
-			case ',':
-				keyboard_report.keycode[0] = 0x36;
-				break;
-			case '>':
-				keyboard_report.modifier = _BV(1); // hold shift
-				// fall through
-			case '.':
-				keyboard_report.keycode[0] = 0x37;
-				break;
-			case '?':
-				keyboard_report.modifier = _BV(1); // hold shift
-				// fall through
-			case '/':
-				keyboard_report.keycode[0] = 0x38;
-				break;
-			case ' ':
-				keyboard_report.keycode[0] = 0x2C;
-				break;
-			case '\t':
-				keyboard_report.keycode[0] = 0x2B;
-				break;
-			case '\n':
-				keyboard_report.keycode[0] = 0x28;
-				break;
-		}
-	}
-}
-
-void send_report_once()
-{
-	// perform usb background tasks until the report can be sent, then send it
-	while (1)
+
+	type_report.modifier = c.modifier; // for this key, the keys already down are not typed again
+	if (report_kb_press(&type_report, 0, key) == 0)
 	{
-		usbPoll(); // this needs to be called at least once every 10 ms
-		if (usbInterruptIsReady())
-		{
-			usbSetInterrupt((uint8_t*)(&keyboard_report), sizeof(keyboard_report)); // send
-			break;
+		// the slots are full, letting go of the others in the same report is enough
+		memset(type_report.keycode, 0, sizeof(type_report.keycode));
+		report_kb_press(&type_report, 0, key);
+	}
+	report_queue(1);
+	type_held = 1;
 
-			// see http://vusb.wikidot.com/driver-api
-		}
+	if (dead) {
+		type_char(' '); // makes the dead key come out on its own
 	}
 }
 
-// stdio's stream will use this funct to type out characters in a string
-void type_out_char(uint8_t ascii, FILE * stream)
+// counts milliseconds, runs with interrupts enabled so it never delays the USB interrupt
+ISR(TIMER1_COMPA_vect, ISR_NOBLOCK)
+{
+	ms_now++;
+}
+
+// returns the milliseconds since start-up, wraps around every 65 seconds so only differences are meaningful
+uint16_t ms_get()
 {
-	keyboard_report_reset(); // release keys
-	send_report_once();
-	ASCII_to_keycode(ascii);
-	send_report_once();
-	keyboard_report_reset(); // release keys
-	send_report_once();
+	uint16_t a, b;
+	do {
+		// the interrupt may change one byte while the other is read, read until it did not
+		a = ms_now;
+		b = ms_now;
+	} while (a != b);
+	return a;
 }
 
 ISR(BADISR_vect)
@@ -923,6 +1518,6 @@ both regions.
 void usbEventResetReady(void)
 {
 	calibrateOscillator();
-	eeprom_update_byte(OSCCAL_EEADDR, OSCCAL);   /* store the calibrated value in EEPROM */
+	osccal_dirty = 1; // saved by usbPollWrapper, we are inside usbPoll here
 }
 #endif
@@ -20,6 +20,67 @@
 #endif
 #endif
 
+#ifdef ENABLE_UNKNOWN_DEBUG
+#undef ENABLE_ADDR_FILTER // codes from unknown remotes must get through to be printed
+#endif
+
+// RAM budget, the ATtiny85 has 512 bytes for static data (.data and .bss) and the stack
+// the stack needs about RAM_STACK_MIN: printf_P, usbPollWrapper down to report_queue, and the USB and Timer1 interrupts on top
+// static RAM of the default options and what each other option adds, from the symbol sizes, keep them up to date when a buffer changes
+// options that are on by default only make the estimate too high when they are turned off
+#define RAM_SIZE				512
+#define RAM_STACK_MIN			128
+#define RAM_DEFAULT				328
+#ifdef ENABLE_VENDOR_CONFIG
+#define RAM_VENDOR_CONFIG		30
+#else
+#define RAM_VENDOR_CONFIG		0
+#endif
+#ifdef ENABLE_FLASH_KEYMAP
+#define RAM_FLASH_KEYMAP		9
+#else
+#define RAM_FLASH_KEYMAP		0
+#endif
+#ifdef ENABLE_SECOND_ENDPOINT
+#define RAM_SECOND_ENDPOINT		46
+#else
+#define RAM_SECOND_ENDPOINT		0
+#endif
+#ifdef ENABLE_TIMEBUFF_DEBUG
+#define RAM_TIMEBUFF_DEBUG		97
+#else
+#define RAM_TIMEBUFF_DEBUG		0
+#endif
+#if defined(ENABLE_FAST_LEARN) && !defined(ENABLE_ADDR_FILTER)
+#define RAM_FAST_LEARN			32 // with the address filter it borrows the filter's RAM instead
+#else
+#define RAM_FAST_LEARN			0
+#endif
+#define RAM_SMALL_OPTIONS		6 // ENABLE_PROFILES, ENABLE_SHIFT_LAYER and ENABLE_LAYOUT_SELECT together, not worth telling apart
+#if RAM_DEFAULT + RAM_VENDOR_CONFIG + RAM_FLASH_KEYMAP + RAM_SECOND_ENDPOINT + RAM_TIMEBUFF_DEBUG + RAM_FAST_LEARN + RAM_SMALL_OPTIONS > RAM_SIZE - RAM_STACK_MIN
+#error "these options leave too little RAM for the stack, see the RAM budget in main.h"
+#endif
+
+// EEPROM layout
+// the learned code table sits at the bottom, followed by the settings log (see settings.c)
+// the last 16 bytes hold the single cell settings of older firmware
+#define KEYMAP_EEADDR         0
+#define KEYMAP_EESIZE         384
+#define SETTINGS_EEADDR       (KEYMAP_EEADDR + KEYMAP_EESIZE)
+#define SETTINGS_MAX          4
+#define OSCCAL_EEADDR         (const uint8_t *)(E2END - 2)
+#define MMKEY_TRANSLATE_EEADDR (const uint8_t *)(E2END - 4)
+
+// IDs for settings_get and settings_set
+enum
+{
+	SETTING_OSCCAL,
+	SETTING_MMKEY,
+	SETTING_PROFILE,
+	SETTING_LAYOUT,
+	SETTINGS_CNT
+};
+
 // hardware pin mapping
 #define IN_PORTx	PORTB
 #define IN_DDRx		DDRB
@@ -46,10 +107,7 @@
 #define PULSEWIDTH_3MS				35
 #define PULSEWIDTH_4MS				47
 #define PULSEWIDTH_5MS				59
-#define TMR1_TIMEOUT_90MS			67
-#define TMR1_TIMEOUT_120MS			90
-#define TMR1_TIMEOUT_3S				9
-#define TMR1_TIMEOUT_5S				15
+#define TMR1_TOP					93 // 12 MHz / 128 / (93 + 1) is 997 Hz
 #elif (F_CPU == 16500000)
 #define PULSEWIDTH_INITIAL_9MS		137
 #define PULSEWIDTH_ON_MIN			4
@@ -58,12 +116,20 @@
 #define PULSEWIDTH_3MS				48
 #define PULSEWIDTH_4MS				65
 #define PULSEWIDTH_5MS				81
-#define TMR1_TIMEOUT_90MS			90
-#define TMR1_TIMEOUT_120MS			120
-#define TMR1_TIMEOUT_3S				12
-#define TMR1_TIMEOUT_5S				20
+#define TMR1_TOP					128 // 16.5 MHz / 128 / (128 + 1) is 999 Hz
 #endif
 
+// Timer1 counts milliseconds, see ms_get
+#define TMR1_CLK_DIV_128			0x08
+// a held button sends a frame every NEC_PERIOD_MS, measured from the start of one leading pulse to the next
+// the key is let go of as soon as the next frame is late by KEY_RELEASE_MARGIN_MS
+#define NEC_LEADER_MS				9
+#define NEC_PERIOD_MS				108
+#define NEC_PERIOD_MIN_MS			96 // the measured period is only used when it is in this range
+#define NEC_PERIOD_MAX_MS			160
+#define KEY_RELEASE_MARGIN_MS		12
+#define PROG_TIMEOUT_MS				5000 // how long programming mode waits for each button
+
 // data structure for boot protocol keyboard report
 // see HID1_11.pdf appendix B section 1
 typedef struct {
@@ -91,10 +157,195 @@ typedef struct
 }
 code_desc_t;
 
+// entries in code_desc_tbl, not counting the null termination
+#ifdef ENABLE_MOUSE
+#define CODE_DESC_CNT 8
+#else
+#define CODE_DESC_CNT 7
+#endif
+
+// header of a stored keymap, followed by count keymap_rec_t
+typedef struct
+{
+	uint16_t	magic;
+	uint8_t		version;
+	uint8_t		count;
+	uint16_t	crc;		// CRC16 (see _crc16_update) of the records
+}
+keymap_hdr_t;
+
+typedef struct
+{
+	uint32_t	ir;
+	uint32_t	kc;
+}
+keymap_rec_t;
+
+// the keys of a chord, see CHORD_TBL in profiles.h
+typedef struct
+{
+	uint8_t		modifier;
+	uint8_t		keycode[5];
+}
+keymap_chord_t;
+
+// how a key repeats while its button is held, see TYPEMATIC_CLASS_TBL in profiles.h
+// in the order of the KEYCODE_TM_ bits in kbrd_codes.h
+enum
+{
+	TYPEMATIC_HOLD, // stays down until the button is let go of, the host repeats it like a real keyboard
+	TYPEMATIC_ONCE, // pressed and let go of once, holding the button does nothing more
+	TYPEMATIC_NAV,
+	TYPEMATIC_VOLUME,
+	TYPEMATIC_CLASS_CNT
+};
+typedef struct
+{
+	uint16_t	delay; // ms from the press to the first repeat, 0 for no repeats
+	uint8_t		rate; // ms between repeats
+	uint8_t		accel_cnt; // after this many repeats...
+	uint8_t		accel_rate; // ...the ms between repeats become this
+}
+typematic_class_t;
+
+#define KEYMAP_MAGIC		0x4B49 // "IK"
+#define KEYMAP_VERSION		2
+#define KEYMAP_MAX_RECORDS	((KEYMAP_EESIZE - sizeof(keymap_hdr_t)) / sizeof(keymap_rec_t))
+
+// state of the stored keymap found at start-up, see usr_keymap_init
+enum
+{
+	KEYMAP_OK,
+	KEYMAP_BLANK,	// nothing learned yet, not a fault
+	KEYMAP_CORRUPT	// the table failed the check and is not used
+};
+
+// matching rule for IR codes, see IR_RULE in nec_defaults.h
+typedef struct
+{
+	uint16_t	addr;		// NEC address, bits 0-15 of the IR code
+	uint16_t	addr_mask;	// address bits that must match
+	uint8_t		cmd_min;	// NEC command range, bits 16-23 of the IR code
+	uint8_t		cmd_max;
+	uint8_t		flags;
+	uint32_t	kc;
+}
+ir_rule_t;
+
+// flags for ir_rule_t
+#define IR_RULE_OFFSET	_BV(0) // add (command - cmd_min) to bits 24-31 of the keycode, only right for keyboard keycodes (report ID 1)
+#define IR_RULE_ANY_ID	_BV(1) // bits 24-31 are a remote ID instead of the inverse command, so they are not checked
+
+// vendor feature report used for configuration over USB, see vendor.c
+#define VCFG_REPORT_ID	5
+#define VCFG_DATA_LEN	13
+#define VCFG_REPORT_LEN	(VCFG_DATA_LEN + 4) // with the report ID, command, argument and status bytes
+
+// commands for the vendor feature report
+enum
+{
+	VCFG_INFO,			// returns keymap version, max records, record count, MMKEY mode, profile, keymap status, flash record count, layout
+	VCFG_REC_READ,		// returns the record at index argument
+	VCFG_REC_CLEAR,		// removes all records
+	VCFG_REC_SET,		// data is a record, replaces the record with the same IR code or adds it
+	VCFG_REC_COMMIT,	// makes the records written so far permanent
+	VCFG_MODE_SET,		// selects MMKEY translation mode argument, returns the mode actually selected
+	VCFG_PROFILE_SET,	// selects keymap profile argument, returns the profile actually selected
+	VCFG_STATS,			// returns ir_stats_t, clears it if argument is not 0
+	VCFG_FLASH_BEGIN,	// starts writing a new flash keymap, the old one is gone (erases the header page)
+	VCFG_FLASH_ADD,		// data is a record, records must be sent in order of IR code
+						// the first record of a page erases it and the last one writes it, never both,
+						// so no command stops the CPU (and USB) for more than one flash operation of about 4.5 ms
+	VCFG_FLASH_COMMIT,	// makes the flash keymap valid (writes the last partial page, then the header page)
+	VCFG_LAYOUT_SET,	// selects host keyboard layout argument (see LAYOUT_LIST), returns the layout actually selected
+};
+
+// status of the vendor feature report
+enum
+{
+	VCFG_OK,
+	VCFG_BUSY,
+	VCFG_ERR_CMD,
+	VCFG_ERR_ARG,
+	VCFG_ERR_FULL
+};
+
+// counters that can be read with VCFG_STATS
+typedef struct
+{
+	uint16_t	frames;		// new codes received
+	uint16_t	repeats;	// repeat frames
+	uint16_t	unknown;	// new codes no keymap layer knows
+	uint16_t	foreign;	// frames dropped by the address filter
+	uint16_t	errors;		// frames that could not be decoded
+}
+ir_stats_t;
+
+#ifdef ENABLE_VENDOR_CONFIG
+extern ir_stats_t ir_stats;
+#define ir_stat_inc(x) do { ir_stats.x++; } while (0)
+#else
+#define ir_stat_inc(x) do { } while (0)
+#endif
+
 ircap_res_t ir_cap(uint32_t*);
 void usbPollWrapper();
+uint16_t ms_get();
 uint32_t ir_to_kb(uint32_t);
+uint32_t pair_tbl_search(const uint32_t*, uint8_t, uint32_t);
 uint32_t usr_ir_to_kb(uint32_t);
+uint8_t usr_keymap_init();
+uint8_t usr_keymap_status();
+void usr_keymap_remove_kc(uint32_t);
+uint8_t usr_keymap_set(uint32_t, uint32_t);
+void usr_keymap_commit();
+uint8_t usr_keymap_count();
+void usr_keymap_read(uint8_t, keymap_rec_t*);
+void usr_keymap_clear();
+uint32_t ir_rule_match(uint32_t);
+void keymap_init();
+uint8_t keymap_fn(uint32_t);
+void keymap_release();
+uint8_t keymap_profile_get();
+char keymap_chord(uint8_t, keymap_chord_t*);
+uint8_t keymap_typematic(uint32_t*, typematic_class_t*);
+char pointer_toggle();
+uint32_t mmkey_translate(uint32_t);
+void layout_init();
+uint8_t layout_get();
+void layout_set(uint8_t);
+uint8_t mmkey_init();
+uint8_t mmkey_next();
+uint8_t mmkey_get();
+void mmkey_set(uint8_t);
+void eeq_poll();
+void eeq_write_byte(uint8_t*, uint8_t);
+void eeq_write_block(const void*, void*, uint8_t);
+void eeq_read_block(void*, const void*, uint8_t);
+void eeq_flush();
+void eeq_hold(char);
+void settings_init();
+uint8_t settings_get(uint8_t);
+void settings_set(uint8_t, uint8_t);
+void addr_filter_init();
+void addr_filter_add(uint16_t, uint16_t);
+void keymap_addr_filter_add();
+void usr_addr_filter_add();
+void ir_rule_addr_filter_add();
+void flashmap_init();
+uint8_t flashmap_count();
+uint32_t flashmap_ir_to_kb(uint32_t);
+void flashmap_addr_filter_add();
+void flashmap_begin();
+uint8_t flashmap_add(keymap_rec_t*);
+uint8_t flashmap_commit();
+void flashmap_abort();
 void usr_prog();
+void usr_prog_fast();
+extern uint32_t* const fast_learn_codes;
+uint8_t* vcfg_report();
+char vcfg_write_start();
+uint8_t vcfg_write(uint8_t*, uint8_t);
+void vcfg_task();
 
 #endif
\ No newline at end of file
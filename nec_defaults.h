@@ -18,7 +18,13 @@
 #define BUT_AF_LEFT			KEYCODE_ARROW_LEFT
 #define BUT_AF_ENTERSAVE	KEYCODE_ENTER
 #define BUT_AF_RIGHT		KEYCODE_ARROW_RIGHT
+#if defined(ENABLE_SHIFT_LAYER)
+#define BUT_AF_010			KEYCODE_FN_SHIFT // "0/10+" becomes the shift button instead, see SHIFT_PAIRS
+#elif defined(ENABLE_PROFILES)
+#define BUT_AF_010			KEYCODE_FN_PROFILE_NEXT // "0/10+" cycles through the keymap profiles instead
+#else
 #define BUT_AF_010			KEYCODE_0
+#endif
 #define BUT_AF_DOWN			KEYCODE_ARROW_DOWN
 #define BUT_AF_RETURN		KEYCODE_BACKSPACE
 #define BUT_AF_1			KEYCODE_1
@@ -60,6 +66,29 @@
 #define BUT_SDR_SOURCE		KEYCODE_ENTER
 #define BUT_SDR_FAVORITE	KEYCODE_HOME
 
+// IR codes of the Adafruit remote, for use in other tables
+#define IR_AF_9				0xE51ABF00
+#define IR_AF_8				0xE619BF00
+#define IR_AF_7				0xE718BF00
+#define IR_AF_6				0xE916BF00
+#define IR_AF_5				0xEA15BF00
+#define IR_AF_4				0xEB14BF00
+#define IR_AF_3				0xED12BF00
+#define IR_AF_2				0xEE11BF00
+#define IR_AF_1				0xEF10BF00
+#define IR_AF_RETURN		0xF10EBF00
+#define IR_AF_DOWN			0xF20DBF00
+#define IR_AF_010			0xF30CBF00
+#define IR_AF_RIGHT			0xF50ABF00
+#define IR_AF_ENTERSAVE		0xF609BF00
+#define IR_AF_LEFT			0xF708BF00
+#define IR_AF_STOPMODE		0xF906BF00
+#define IR_AF_UP			0xFA05BF00
+#define IR_AF_SETUP			0xFB04BF00
+#define IR_AF_VOL_UP		0xFD02BF00
+#define IR_AF_PLAYPAUSE		0xFE01BF00
+#define IR_AF_VOL_DOWN		0xFF00BF00
+
 #define BUT_APPLE_UP		KEYCODE_EQUAL
 #define BUT_APPLE_DOWN		KEYCODE_MINUS
 #define BUT_APPLE_LEFT		KEYCODE_ARROW_LEFT
@@ -68,60 +97,107 @@
 #define BUT_APPLE_MENU		KEYCODE_ESC
 #define BUT_APPLE_SELECT	KEYCODE_ENTER
 
+// sorted by IR code so the table can be binary searched, keep it that way when adding codes
 #define IR_BUT_PAIRS {				\
-0xFF00BF00, BUT_AF_VOL_DOWN,		\
-0xFE01BF00, BUT_AF_PLAYPAUSE,		\
-0xFD02BF00, BUT_AF_VOL_UP,			\
-0xFB04BF00, BUT_AF_SETUP,			\
-0xFA05BF00, BUT_AF_UP,				\
-0xF906BF00, BUT_AF_STOPMODE,		\
-0xF708BF00, BUT_AF_LEFT,			\
-0xF609BF00, BUT_AF_ENTERSAVE,		\
-0xF50ABF00, BUT_AF_RIGHT,			\
-0xF30CBF00, BUT_AF_010,				\
-0xF20DBF00, BUT_AF_DOWN,			\
-0xF10EBF00, BUT_AF_RETURN,			\
-0xEF10BF00, BUT_AF_1,				\
-0xEE11BF00, BUT_AF_2,				\
-0xED12BF00, BUT_AF_3,				\
-0xEB14BF00, BUT_AF_4,				\
-0xEA15BF00, BUT_AF_5,				\
-0xE916BF00, BUT_AF_6,				\
-0xE718BF00, BUT_AF_7,				\
-0xE619BF00, BUT_AF_8,				\
+0xE11E6B86, BUT_SDR_PAUSE,			\
+0xE21D6B86, BUT_SDR_REC,			\
+0xE31C6B86, BUT_SDR_LIVETV,			\
+0xE41B6B86, BUT_SDR_TELETEXT,		\
+0xE51A6B86, BUT_SDR_FAVORITE,		\
 0xE51ABF00, BUT_AF_9,				\
+0xE6196B86, BUT_SDR_SNAPSHOT,		\
+0xE619BF00, BUT_AF_8,				\
+0xE7186B86, BUT_SDR_VOL_DOWN,		\
+0xE718BF00, BUT_AF_7,				\
+0xE916BF00, BUT_AF_6,				\
+0xEA156B86, BUT_SDR_CHAN_DOWN,		\
+0xEA15BF00, BUT_AF_5,				\
+0xEB14BF00, BUT_AF_4,				\
 0xEC136B86, BUT_SDR_MUTE,			\
-0xEE116B86, BUT_SDR_EPG,			\
-0xE31C6B86, BUT_SDR_LIVETV,			\
 0xED126B86, BUT_SDR_POWER,			\
-0xFE016B86, BUT_SDR_1,				\
-0xFD026B86, BUT_SDR_2,				\
-0xFC036B86, BUT_SDR_3,				\
-0xF20D6B86, BUT_SDR_STEREO,			\
-0xFB046B86, BUT_SDR_4,				\
-0xFA056B86, BUT_SDR_5,				\
-0xF9066B86, BUT_SDR_6,				\
-0xE6196B86, BUT_SDR_SNAPSHOT,		\
-0xF8076B86, BUT_SDR_7,				\
-0xF7086B86, BUT_SDR_8,				\
-0xF6096B86, BUT_SDR_9,				\
+0xED12BF00, BUT_AF_3,				\
+0xEE116B86, BUT_SDR_EPG,			\
+0xEE11BF00, BUT_AF_2,				\
 0xEF106B86, BUT_SDR_ZOOM,			\
+0xEF10BF00, BUT_AF_1,				\
+0xF00F6B86, BUT_SDR_SOURCE,			\
+0xF10E6B86, BUT_SDR_STOP,			\
+0xF10EBF00, BUT_AF_RETURN,			\
+0xF20D6B86, BUT_SDR_STEREO,			\
+0xF20DBF00, BUT_AF_DOWN,			\
+0xF30C6B86, BUT_SDR_VOL_UP,			\
+0xF30CBF00, BUT_AF_010,				\
+0xF40B6B86, BUT_SDR_CHAN_UP,		\
 0xF50A6B86, BUT_SDR_RECALL,			\
+0xF50ABF00, BUT_AF_RIGHT,			\
+0xF609BF00, BUT_AF_ENTERSAVE,		\
+0xF708BF00, BUT_AF_LEFT,			\
+0xF906BF00, BUT_AF_STOPMODE,		\
+0xFA05BF00, BUT_AF_UP,				\
+0xFB04BF00, BUT_AF_SETUP,			\
+0xFD02BF00, BUT_AF_VOL_UP,			\
+0xFE01BF00, BUT_AF_PLAYPAUSE,		\
 0xFF006B86, BUT_SDR_0,				\
-0xF40B6B86, BUT_SDR_CHAN_UP,		\
-0xF30C6B86, BUT_SDR_VOL_UP,			\
-0xE41B6B86, BUT_SDR_TELETEXT,		\
-0xE21D6B86, BUT_SDR_REC,			\
-0xEA156B86, BUT_SDR_CHAN_DOWN,		\
-0xE7186B86, BUT_SDR_VOL_DOWN,		\
-0xF10E6B86, BUT_SDR_STOP,			\
-0xE11E6B86, BUT_SDR_PAUSE,			\
-0xF00F6B86, BUT_SDR_SOURCE,			\
-0xE51A6B86, BUT_SDR_FAVORITE,		\
+0xFF00BF00, BUT_AF_VOL_DOWN,		\
 0,0,} // null terminate to signal end of table
 
+// keycode translation used by the MMKEY translate modes, ASCII keycode on the left, replacement on the right
+// each mode is a section of pairs terminated by 0,0, the order of the sections is the order the modes are cycled in
+// mode 0 is always "no translation", the first section here is mode 1 and so on
+// an empty section (an extra 0,0) signals the end of the table
+#define MMKEY_TRANSLATE_PAIRS {					\
+KEYCODE_EQUAL,			KEYCODE_VOL_UP,				\
+KEYCODE_ARROW_UP,		KEYCODE_VOL_UP,				\
+KEYCODE_MINUS,			KEYCODE_VOL_DOWN,			\
+KEYCODE_ARROW_DOWN,		KEYCODE_VOL_DOWN,			\
+KEYCODE_ARROW_RIGHT,	KEYCODE_SCAN_NEXT_TRACK,	\
+KEYCODE_ARROW_LEFT,		KEYCODE_SCAN_PREV_TRACK,	\
+KEYCODE_X,				KEYCODE_STOP,				\
+KEYCODE_SPACE,			KEYCODE_PLAYPAUSE,			\
+KEYCODE_ESC,			KEYCODE_KB_MENU,			\
+0,0,												\
+0,0,} // end of all modes
+
+// rules match IR codes by NEC address and command instead of by the whole 32 bit code
+// the address is bits 0-15 of the IR code and the command is bits 16-23, bits 24-31 must be the inverse of the command
+// IR_RULE_PAIRED is for remotes that put a pairing ID in the last byte instead (like the Apple remote), it is not checked
+// IR_RULE(address, address mask, command, keycode) matches a single command
+// IR_RULE_RANGE(address, address mask, first command, last command, keycode) matches a block of commands,
+// the distance from the first command is added to the key in bits 24-31, so the keycodes must be consecutive keyboard keys
+// consumer, system and mouse keycodes keep their usage in other bits, a range of them comes out wrong, use one IR_RULE each
+// the address mask selects which address bits must match, use 0xFFFF for an exact match
+#define IR_RULE(a, m, c, k)				{ .addr = (a), .addr_mask = (m), .cmd_min = (c), .cmd_max = (c), .flags = 0, .kc = (k) }
+#define IR_RULE_PAIRED(a, m, c, k)		{ .addr = (a), .addr_mask = (m), .cmd_min = (c), .cmd_max = (c), .flags = IR_RULE_ANY_ID, .kc = (k) }
+#define IR_RULE_RANGE(a, m, c1, c2, k)	{ .addr = (a), .addr_mask = (m), .cmd_min = (c1), .cmd_max = (c2), .flags = IR_RULE_OFFSET, .kc = (k) }
+
+#define SDR_ADDR	0x6B86
+#define APPLE_ADDR	0x87EE // this was discovered by experimentation
+
+#ifdef ENABLE_DEFAULT_CODES
+// the whole digit block of the SDR remote, BUT_SDR_1 to BUT_SDR_9
+#define IR_RULES_SDR										\
+IR_RULE_RANGE(SDR_ADDR, 0xFFFF, 0x01, 0x09, BUT_SDR_1),
+#else
+#define IR_RULES_SDR
+#endif
+
 #ifdef ENABLE_APPLE_DEFAULTS
-#include <apple_codes.c>
+// commands discovered by experimentation
+#define IR_RULES_APPLE												\
+IR_RULE_PAIRED(APPLE_ADDR, 0xFFFF, 0x0A, BUT_APPLE_UP),				\
+IR_RULE_PAIRED(APPLE_ADDR, 0xFFFF, 0x0C, BUT_APPLE_DOWN),			\
+IR_RULE_PAIRED(APPLE_ADDR, 0xFFFF, 0x09, BUT_APPLE_LEFT),			\
+IR_RULE_PAIRED(APPLE_ADDR, 0xFFFF, 0x06, BUT_APPLE_RIGHT),			\
+IR_RULE_PAIRED(APPLE_ADDR, 0xFFFF, 0x5F, BUT_APPLE_PLAYPAUSE),		\
+IR_RULE_PAIRED(APPLE_ADDR, 0xFFFF, 0x03, BUT_APPLE_MENU),			\
+IR_RULE_PAIRED(APPLE_ADDR, 0xFFFF, 0x5C, BUT_APPLE_SELECT),
+#else
+#define IR_RULES_APPLE
+#endif
+
+#if defined(ENABLE_DEFAULT_CODES) || defined(ENABLE_APPLE_DEFAULTS)
+#define ENABLE_IR_RULES
+#define IR_RULES { IR_RULES_SDR IR_RULES_APPLE { .kc = 0 }, } // a keycode of 0 signals end of table
 #endif
 
 #endif
@@ -0,0 +1,134 @@
+#ifndef PROFILES_H
+#define PROFILES_H
+
+#include <kbrd_codes.h>
+#include <xbmc_keys.h>
+#include <nec_defaults.h>
+
+// keymap profiles, only one is active at a time and it overrides the default tables (but not learned codes)
+// profile 0 is always the plain default tables, the profiles listed here come after it in order
+// KEYCODE_FN_PROFILE_NEXT and KEYCODE_FN_PROFILE(n) switch between them, so the number is the place in this list
+// X(identifier)
+#define PROFILE_LIST(X)				\
+X(kodi)								\
+X(browser)							\
+X(present)
+
+// every profile is a table of IR code and keycode pairs, named PROFILE_PAIRS_ followed by the identifier
+// these must be sorted by IR code so they can be binary searched, and are not null terminated
+
+// buttons that Kodi (XBMC) has a better use for, see xbmc_keys.h
+#define PROFILE_PAIRS_kodi {					\
+IR_AF_9,			XBMC_SKIPFORWARD,			\
+IR_AF_8,			XBMC_INFO,					\
+IR_AF_7,			XBMC_SKIPBACKWARD,			\
+IR_AF_6,			XBMC_FASTFORWARD,			\
+IR_AF_5,			XBMC_PLAY,					\
+IR_AF_4,			XBMC_REWIND,				\
+IR_AF_3,			XBMC_AUDIODELAY,			\
+IR_AF_2,			XBMC_NEXTSUBTITLE,			\
+IR_AF_1,			XBMC_TOGGLESUBTITLES,		\
+IR_AF_SETUP,		XBMC_CONTEXTUALMENU,		\
+}
+
+// back and forward on the arrows, scrolling by page, reload, and digits select tabs
+#define PROFILE_PAIRS_browser {										\
+IR_AF_9,			KEYCODE_9 | KEYCODE_MOD_LEFT_CONTROL,			\
+IR_AF_8,			KEYCODE_8 | KEYCODE_MOD_LEFT_CONTROL,			\
+IR_AF_7,			KEYCODE_7 | KEYCODE_MOD_LEFT_CONTROL,			\
+IR_AF_6,			KEYCODE_6 | KEYCODE_MOD_LEFT_CONTROL,			\
+IR_AF_5,			KEYCODE_5 | KEYCODE_MOD_LEFT_CONTROL,			\
+IR_AF_4,			KEYCODE_4 | KEYCODE_MOD_LEFT_CONTROL,			\
+IR_AF_3,			KEYCODE_3 | KEYCODE_MOD_LEFT_CONTROL,			\
+IR_AF_2,			KEYCODE_2 | KEYCODE_MOD_LEFT_CONTROL,			\
+IR_AF_1,			KEYCODE_1 | KEYCODE_MOD_LEFT_CONTROL,			\
+IR_AF_DOWN,			KEYCODE_PAGE_DOWN,								\
+IR_AF_RIGHT,		KEYCODE_ARROW_RIGHT | KEYCODE_MOD_LEFT_ALT,		\
+IR_AF_LEFT,			KEYCODE_ARROW_LEFT | KEYCODE_MOD_LEFT_ALT,		\
+IR_AF_UP,			KEYCODE_PAGE_UP,								\
+IR_AF_SETUP,		KEYCODE_F5,										\
+}
+
+// slide show controls, for most presentation software
+#define PROFILE_PAIRS_present {					\
+IR_AF_DOWN,			KEYCODE_PAGE_DOWN,			\
+IR_AF_RIGHT,		KEYCODE_PAGE_DOWN,			\
+IR_AF_ENTERSAVE,	KEYCODE_B,					\
+IR_AF_LEFT,			KEYCODE_PAGE_UP,			\
+IR_AF_STOPMODE,		KEYCODE_W,					\
+IR_AF_UP,			KEYCODE_PAGE_UP,			\
+IR_AF_PLAYPAUSE,	KEYCODE_F5,					\
+}
+
+// the shift layer, used while the KEYCODE_FN_SHIFT button is held, or for one press after it is tapped
+// buttons that are not in here keep their normal meaning while shifted
+// this must be sorted by IR code so it can be binary searched, and is not null terminated
+#ifdef ENABLE_PROFILES
+#define SHIFT_AF_SETUP		KEYCODE_FN_PROFILE_NEXT
+#else
+#define SHIFT_AF_SETUP		KEYCODE_APP
+#endif
+#ifdef ENABLE_MOUSE
+#define SHIFT_AF_STOPMODE	KEYCODE_FN_POINTER
+#else
+#define SHIFT_AF_STOPMODE	KEYCODE_STOP
+#endif
+#define SHIFT_PAIRS {							\
+IR_AF_9,			KEYCODE_F9,					\
+IR_AF_8,			KEYCODE_F8,					\
+IR_AF_7,			KEYCODE_F7,					\
+IR_AF_6,			KEYCODE_F6,					\
+IR_AF_5,			KEYCODE_F5,					\
+IR_AF_4,			KEYCODE_F4,					\
+IR_AF_3,			KEYCODE_F3,					\
+IR_AF_2,			KEYCODE_F2,					\
+IR_AF_1,			KEYCODE_F1,					\
+IR_AF_RETURN,		KEYCODE_DELETE,				\
+IR_AF_DOWN,			KEYCODE_PAGE_DOWN,			\
+IR_AF_010,			KEYCODE_0,					\
+IR_AF_RIGHT,		KEYCODE_END,				\
+IR_AF_ENTERSAVE,	KEYCODE_TAB,				\
+IR_AF_LEFT,			KEYCODE_HOME,				\
+IR_AF_STOPMODE,		SHIFT_AF_STOPMODE,			\
+IR_AF_UP,			KEYCODE_PAGE_UP,			\
+IR_AF_SETUP,		SHIFT_AF_SETUP,				\
+IR_AF_VOL_UP,		KEYCODE_VOL_UP,				\
+IR_AF_PLAYPAUSE,	KEYCODE_MUTE,				\
+IR_AF_VOL_DOWN,		KEYCODE_VOL_DOWN,			\
+}
+
+// the chords, in the order of their KEYCODE_CHORD(n) codes in kbrd_codes.h
+// modifiers, then up to 5 keys that are pressed together, unused keys are 0
+#define CHORD_TBL {																				\
+{ CHORD_MOD(KEYCODE_MOD_LEFT_CONTROL | KEYCODE_MOD_LEFT_ALT), { CHORD_KEY(KEYCODE_DELETE) } },	\
+{ CHORD_MOD(KEYCODE_MOD_LEFT_CONTROL | KEYCODE_MOD_LEFT_SHIFT), { CHORD_KEY(KEYCODE_ESC) } },	\
+{ CHORD_MOD(KEYCODE_MOD_LEFT_ALT | KEYCODE_MOD_LEFT_SHIFT), { CHORD_KEY(KEYCODE_TAB) } },		\
+}
+
+// repeating of held buttons, one entry per class in the order of the TYPEMATIC_ enum in main.h
+// delay, rate, after how many repeats to speed up and the faster rate, all in ms
+// the classes that repeat press and let go of their key for every repeat, instead of leaving the repeating to the host
+#define TYPEMATIC_CLASS_TBL {		\
+{ 0,	0,		0,	0 },	/* HOLD */	\
+{ 0,	0,		0,	0 },	/* ONCE */	\
+{ 400,	100,	10,	40 },	/* NAV */	\
+{ 300,	150,	6,	60 },	/* VOLUME */\
+}
+
+// the class of each keycode (after MMKEY translation), keycodes that are not in here are TYPEMATIC_HOLD
+#define TYPEMATIC_KEY_PAIRS {				\
+KEYCODE_MUTE,			TYPEMATIC_ONCE,		\
+KEYCODE_PLAYPAUSE,		TYPEMATIC_ONCE,		\
+KEYCODE_ARROW_UP,		TYPEMATIC_NAV,		\
+KEYCODE_ARROW_DOWN,		TYPEMATIC_NAV,		\
+KEYCODE_ARROW_LEFT,		TYPEMATIC_NAV,		\
+KEYCODE_ARROW_RIGHT,	TYPEMATIC_NAV,		\
+KEYCODE_PAGE_UP,		TYPEMATIC_NAV,		\
+KEYCODE_PAGE_DOWN,		TYPEMATIC_NAV,		\
+KEYCODE_VOL_UP,			TYPEMATIC_VOLUME,	\
+KEYCODE_VOL_DOWN,		TYPEMATIC_VOLUME,	\
+KEYCODE_MINUS,			TYPEMATIC_VOLUME,	\
+KEYCODE_EQUAL,			TYPEMATIC_VOLUME,	\
+}
+
+#endif
@@ -0,0 +1,89 @@
+#include "main.h"
+#include <avr/eeprom.h>
+
+// small settings (like the OSCCAL value and the MMKEY mode) are not kept in one EEPROM cell each
+// every setting has its own ring of SETTINGS_RING_SLOTS records, and every change is written to the next record of the ring
+// so the wear is spread over all of them, which makes the EEPROM last SETTINGS_RING_SLOTS times longer
+// a record is a sequence number followed by the value, the latest record is the one not followed by the next sequence number
+// an erased record has a sequence number of 0xFF, so sequence numbers count from 0 to 254 and wrap around
+
+#define SETTINGS_RING_SLOTS 14
+#define SETTINGS_SEQ_EMPTY 0xFF
+#define SETTINGS_SLOT_EEADDR(id, i) ((uint8_t*)(SETTINGS_EEADDR + ((id) * SETTINGS_RING_SLOTS + (i)) * 2))
+
+#if (SETTINGS_EEADDR + SETTINGS_MAX * SETTINGS_RING_SLOTS * 2) > (E2END + 1 - 16)
+#error "settings log overlaps the top of the EEPROM"
+#endif
+#if SETTINGS_CNT > SETTINGS_MAX
+#error "too many settings for the settings log"
+#endif
+
+static uint8_t settings_val[SETTINGS_CNT]; // RAM copy of the latest value of each setting
+static uint8_t settings_pos[SETTINGS_CNT]; // slot holding the latest record
+static uint8_t settings_seq[SETTINGS_CNT]; // sequence number of the latest record
+
+static uint8_t settings_seq_next(uint8_t seq)
+{
+	return (seq >= SETTINGS_SEQ_EMPTY - 1) ? 0 : (seq + 1);
+}
+
+// the cells settings used to be stored in before there was a settings log, only read to carry the old value over
+static uint8_t settings_legacy(uint8_t id)
+{
+	if (id == SETTING_OSCCAL) return eeprom_read_byte(OSCCAL_EEADDR);
+	if (id == SETTING_MMKEY) return eeprom_read_byte(MMKEY_TRANSLATE_EEADDR);
+	return 0xFF;
+}
+
+// finds the latest record of every setting, must be called once at start-up before any setting is used
+void settings_init()
+{
+	for (uint8_t id = 0; id < SETTINGS_CNT; id++)
+	{
+		// read all the sequence numbers of the ring in one go
+		uint8_t seq[SETTINGS_RING_SLOTS];
+		for (uint8_t i = 0; i < SETTINGS_RING_SLOTS; i++) {
+			seq[i] = eeprom_read_byte(SETTINGS_SLOT_EEADDR(id, i));
+		}
+
+		// nothing written yet, the first write goes into slot 0
+		settings_pos[id] = SETTINGS_RING_SLOTS - 1;
+		settings_seq[id] = SETTINGS_SEQ_EMPTY - 1;
+		settings_val[id] = settings_legacy(id);
+
+		for (uint8_t i = 0; i < SETTINGS_RING_SLOTS; i++)
+		{
+			uint8_t n = (i + 1) % SETTINGS_RING_SLOTS;
+			if (seq[i] != SETTINGS_SEQ_EMPTY && seq[n] != settings_seq_next(seq[i]))
+			{
+				settings_pos[id] = i;
+				settings_seq[id] = seq[i];
+				settings_val[id] = eeprom_read_byte(SETTINGS_SLOT_EEADDR(id, i) + 1);
+				break;
+			}
+		}
+	}
+}
+
+uint8_t settings_get(uint8_t id)
+{
+	return settings_val[id];
+}
+
+// changes a setting, nothing is written if the value is the same
+void settings_set(uint8_t id, uint8_t val)
+{
+	if (settings_val[id] == val) {
+		return;
+	}
+	settings_val[id] = val;
+
+	uint8_t i = (settings_pos[id] + 1) % SETTINGS_RING_SLOTS;
+	uint8_t seq = settings_seq_next(settings_seq[id]);
+	// the value goes in first, the record only becomes the latest one once its sequence number is written
+	// so losing power half way leaves the previous record as the latest, the write queue keeps this order
+	eeq_write_byte(SETTINGS_SLOT_EEADDR(id, i) + 1, val);
+	eeq_write_byte(SETTINGS_SLOT_EEADDR(id, i), seq);
+	settings_pos[id] = i;
+	settings_seq[id] = seq;
+}
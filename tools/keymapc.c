@@ -0,0 +1,604 @@
+// keymapc, compiles a text keymap into something the IRKey can use without rebuilding the firmware
+// runs on the PC, not on the AVR, build it with "make keymapc"
+//
+// usage: keymapc [-I dir] [-o out.eep | -o out.h] [-n NAME] [-u /dev/hidrawN [-F]] keymap.txt
+//
+// the keymap is a text file, one entry per line, "#" starts a comment
+//
+//   remote af 0xBF00            gives a name to the address (bits 0-15) of a remote
+//   af 0x1A KEYCODE_9           remote name, command byte (the inverse byte is filled in), action
+//   IR_AF_UP KEYCODE_ARROW_UP   IR code by name (from nec_defaults.h), action
+//   0x02FD87EE KEYCODE_MUTE     raw 32 bit IR code, needed for remotes that do not send the inverse command byte
+//
+// the action is a KEYCODE_ or XBMC_ name from kbrd_codes.h or xbmc_keys.h, or a raw 32 bit keycode
+// several of them joined with "|" (no spaces) are or-ed together, like KEYCODE_ARROW_UP|KEYCODE_TM_NAV
+// names are read from the headers every time, so new keycodes do not need a new keymapc
+//
+// an output file ending in .h gets a sorted PROGMEM pair table (for profiles.h, see PROFILE_LIST)
+// anything else gets an Intel HEX EEPROM image of the learned keymap (see keymap_hdr_t), write it with "make burneep"
+// -u uploads the keymap straight into a running IRKey built with ENABLE_VENDOR_CONFIG, see vendor.c
+// with -F it goes into the much bigger flash keymap instead (ENABLE_FLASH_KEYMAP, see flashmap.c)
+// without -o or -u the keymap is only checked
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/hidraw.h>
+
+// these must match main.h, the sizes are of the packed structs
+#define KEYMAP_MAGIC		0x4B49
+#define KEYMAP_VERSION		2
+#define KEYMAP_HDR_SIZE		6
+#define KEYMAP_REC_SIZE		8
+
+// these must match the vendor feature report in main.h
+#define VCFG_REPORT_ID		5
+#define VCFG_REPORT_LEN		17
+#define VCFG_INFO			0
+#define VCFG_REC_CLEAR		2
+#define VCFG_REC_SET		3
+#define VCFG_REC_COMMIT		4
+#define VCFG_FLASH_BEGIN	8
+#define VCFG_FLASH_ADD		9
+#define VCFG_FLASH_COMMIT	10
+#define VCFG_OK				0
+#define VCFG_BUSY			1
+
+#define FLASHMAP_MAX_RECORDS 255 // see flashmap.c
+#define FLASHMAP_PAGE_RECS	8 // records in one flash page (SPM_PAGESIZE of the ATtiny85 is 64)
+#define FLASH_STALL_US		10000 // the device does not answer while it erases or writes a flash page (about 4.5 ms), see VCFG_FLASH_ADD
+#define VCFG_RETRIES		10
+
+#define MAX_SYMS			1024
+#define MAX_REMOTES			32
+#define MAX_ENTRIES			256
+#define MAX_LINE			256
+
+typedef struct
+{
+	char		name[64];
+	char		val[64];
+	int			multi; // defined more than once with different values, so the value depends on the build options
+}
+sym_t;
+
+typedef struct
+{
+	char		name[32];
+	uint16_t	addr;
+}
+remote_t;
+
+typedef struct
+{
+	uint32_t	ir;
+	uint32_t	kc;
+	int			line;
+}
+entry_t;
+
+static sym_t syms[MAX_SYMS];
+static int sym_cnt = 0;
+static remote_t remotes[MAX_REMOTES];
+static int remote_cnt = 0;
+static entry_t entries[MAX_ENTRIES];
+static int entry_cnt = 0;
+
+static const char* keymap_fname;
+static int errors = 0;
+static const char* sym_multi = NULL; // the name that made the last sym_resolve fail because it is defined more than once
+
+static void error(int line, const char* msg, const char* arg)
+{
+	fprintf(stderr, "%s:%d: %s%s%s\n", keymap_fname, line, msg, arg ? ": " : "", arg ? arg : "");
+	if (sym_multi != NULL)
+	{
+		fprintf(stderr, "%s:%d: %s has more than one #define (under #ifdef), use its value instead\n", keymap_fname, line, sym_multi);
+		sym_multi = NULL;
+	}
+	errors++;
+}
+
+// reads the object-like "#define NAME VALUE" lines of a header, anything more complicated is ignored
+// keymapc does not know the build options, so a name that is defined twice with different values
+// (like under different #ifdef) cannot be used, sym_resolve refuses it
+static int sym_load(const char* dir, const char* fname)
+{
+	char path[512];
+	snprintf(path, sizeof(path), "%s/%s", dir, fname);
+	FILE* f = fopen(path, "r");
+	if (f == NULL) {
+		return -1;
+	}
+
+	char line[MAX_LINE];
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+		char name[64], val[64];
+		if (sscanf(line, " #define %63[A-Za-z0-9_] %63s", name, val) != 2) {
+			continue;
+		}
+		if (strchr(val, '(') != NULL || strchr(val, '{') != NULL) {
+			continue; // function-like macros and tables
+		}
+
+		int dup = 0;
+		for (int i = 0; i < sym_cnt; i++)
+		{
+			if (strcmp(syms[i].name, name) == 0)
+			{
+				if (strcmp(syms[i].val, val) != 0) syms[i].multi = 1;
+				dup = 1;
+			}
+		}
+		if (dup || sym_cnt >= MAX_SYMS) {
+			continue;
+		}
+		strcpy(syms[sym_cnt].name, name);
+		strcpy(syms[sym_cnt].val, val);
+		syms[sym_cnt].multi = 0;
+		sym_cnt++;
+	}
+
+	fclose(f);
+	return 0;
+}
+
+// turns a number or a name into a value, following names that are defined as other names
+// returns 0 if it does not resolve to a number, or if a name on the way has more than one #define
+static int sym_resolve(const char* s, uint32_t* out)
+{
+	sym_multi = NULL;
+	for (int depth = 0; depth < 8; depth++)
+	{
+		if (isdigit((unsigned char)s[0]))
+		{
+			char* end;
+			unsigned long v = strtoul(s, &end, 0);
+			while (*end == 'u' || *end == 'U' || *end == 'l' || *end == 'L') end++;
+			if (*end != '\0') {
+				return 0;
+			}
+			*out = (uint32_t)v;
+			return 1;
+		}
+
+		const sym_t* next = NULL;
+		for (int i = 0; i < sym_cnt; i++) {
+			if (strcmp(syms[i].name, s) == 0) next = &syms[i];
+		}
+		if (next == NULL) {
+			return 0;
+		}
+		if (next->multi) {
+			sym_multi = next->name;
+			return 0;
+		}
+		s = next->val;
+	}
+	return 0;
+}
+
+// gets KEYMAP_EESIZE from main.h so the size limit always matches the firmware
+static int keymap_max_records()
+{
+	uint32_t eesize;
+	if (!sym_resolve("KEYMAP_EESIZE", &eesize)) {
+		eesize = 384;
+	}
+	return (eesize - KEYMAP_HDR_SIZE) / KEYMAP_REC_SIZE;
+}
+
+// resolves an action, the values joined with "|" are or-ed together
+static int action_resolve(const char* s, uint32_t* out)
+{
+	char buf[MAX_LINE];
+	snprintf(buf, sizeof(buf), "%s", s);
+	*out = 0;
+	for (char* t = strtok(buf, "|"); t != NULL; t = strtok(NULL, "|"))
+	{
+		uint32_t v;
+		if (!sym_resolve(t, &v)) {
+			return 0;
+		}
+		*out |= v;
+	}
+	return 1;
+}
+
+static remote_t* remote_find(const char* name)
+{
+	for (int i = 0; i < remote_cnt; i++) {
+		if (strcmp(remotes[i].name, name) == 0) return &remotes[i];
+	}
+	return NULL;
+}
+
+static void keymap_parse_line(char* line, int ln)
+{
+	char* c = strchr(line, '#');
+	if (c != NULL) *c = '\0';
+
+	char* tok[4];
+	int n = 0;
+	for (char* t = strtok(line, " \t\r\n"); t != NULL; t = strtok(NULL, " \t\r\n"))
+	{
+		if (n == 4) {
+			error(ln, "too many fields", NULL);
+			return;
+		}
+		tok[n++] = t;
+	}
+	if (n == 0) {
+		return;
+	}
+
+	if (strcmp(tok[0], "remote") == 0)
+	{
+		uint32_t addr;
+		if (n != 3) {
+			error(ln, "expected: remote NAME ADDRESS", NULL);
+			return;
+		}
+		if (!sym_resolve(tok[2], &addr) || addr > 0xFFFF) {
+			error(ln, "bad remote address", tok[2]);
+			return;
+		}
+		if (remote_find(tok[1]) != NULL) {
+			error(ln, "remote defined twice", tok[1]);
+			return;
+		}
+		if (remote_cnt >= MAX_REMOTES || strlen(tok[1]) >= sizeof(remotes[0].name)) {
+			error(ln, "too many remotes or name too long", tok[1]);
+			return;
+		}
+		strcpy(remotes[remote_cnt].name, tok[1]);
+		remotes[remote_cnt].addr = addr;
+		remote_cnt++;
+		return;
+	}
+
+	uint32_t ir, kc;
+	const char* action;
+	if (n == 3)
+	{
+		remote_t* r = remote_find(tok[0]);
+		uint32_t cmd;
+		if (r == NULL) {
+			error(ln, "unknown remote", tok[0]);
+			return;
+		}
+		if (!sym_resolve(tok[1], &cmd) || cmd > 0xFF) {
+			error(ln, "bad command byte", tok[1]);
+			return;
+		}
+		ir = r->addr | (cmd << 16) | ((~cmd & 0xFF) << 24);
+		action = tok[2];
+	}
+	else if (n == 2)
+	{
+		if (!sym_resolve(tok[0], &ir)) {
+			error(ln, "unknown IR code", tok[0]);
+			return;
+		}
+		action = tok[1];
+	}
+	else
+	{
+		error(ln, "expected: [REMOTE COMMAND | IRCODE] ACTION", NULL);
+		return;
+	}
+
+	if (!action_resolve(action, &kc) || kc == 0) {
+		error(ln, "unknown action", action);
+		return;
+	}
+	if (ir == 0) {
+		error(ln, "IR code 0 is not allowed", NULL);
+		return;
+	}
+
+	for (int i = 0; i < entry_cnt; i++)
+	{
+		if (entries[i].ir == ir)
+		{
+			char buf[64];
+			snprintf(buf, sizeof(buf), "0x%08X, first seen on line %d", ir, entries[i].line);
+			error(ln, "duplicate IR code", buf);
+			return;
+		}
+	}
+	if (entry_cnt >= MAX_ENTRIES) {
+		error(ln, "too many entries", NULL);
+		return;
+	}
+	entries[entry_cnt].ir = ir;
+	entries[entry_cnt].kc = kc;
+	entries[entry_cnt].line = ln;
+	entry_cnt++;
+}
+
+static int entry_cmp(const void* a, const void* b)
+{
+	uint32_t x = ((const entry_t*)a)->ir, y = ((const entry_t*)b)->ir;
+	return (x > y) - (x < y);
+}
+
+// same as _crc16_update from avr-libc
+static uint16_t crc16_update(uint16_t crc, uint8_t a)
+{
+	crc ^= a;
+	for (int i = 0; i < 8; i++) {
+		crc = (crc & 1) ? ((crc >> 1) ^ 0xA001) : (crc >> 1);
+	}
+	return crc;
+}
+
+static void put_le(uint8_t* p, uint32_t v, int n)
+{
+	for (int i = 0; i < n; i++) p[i] = v >> (i * 8);
+}
+
+static void hex_record(FILE* f, uint16_t addr, uint8_t type, const uint8_t* d, int n)
+{
+	uint8_t sum = n + (addr >> 8) + (addr & 0xFF) + type;
+	fprintf(f, ":%02X%04X%02X", n, addr, type);
+	for (int i = 0; i < n; i++) {
+		fprintf(f, "%02X", d[i]);
+		sum += d[i];
+	}
+	fprintf(f, "%02X\n", (uint8_t)-sum);
+}
+
+// the image only covers the header and the records, so the settings log and the rest of the EEPROM are left alone
+static int write_eep(const char* fname, int* size)
+{
+	uint8_t img[KEYMAP_HDR_SIZE + MAX_ENTRIES * KEYMAP_REC_SIZE];
+	uint16_t crc = 0xFFFF;
+	int len = KEYMAP_HDR_SIZE;
+	for (int i = 0; i < entry_cnt; i++)
+	{
+		put_le(&img[len], entries[i].ir, 4);
+		put_le(&img[len + 4], entries[i].kc, 4);
+		for (int j = 0; j < KEYMAP_REC_SIZE; j++) {
+			crc = crc16_update(crc, img[len + j]);
+		}
+		len += KEYMAP_REC_SIZE;
+	}
+	put_le(&img[0], KEYMAP_MAGIC, 2);
+	img[2] = KEYMAP_VERSION;
+	img[3] = entry_cnt;
+	put_le(&img[4], crc, 2);
+
+	FILE* f = fopen(fname, "w");
+	if (f == NULL) {
+		return -1;
+	}
+	for (int i = 0; i < len; i += 16) {
+		hex_record(f, i, 0x00, &img[i], (len - i) > 16 ? 16 : (len - i));
+	}
+	hex_record(f, 0, 0x01, NULL, 0);
+	*size = len;
+	return fclose(f);
+}
+
+static int write_header(const char* fname, const char* name, int* size)
+{
+	FILE* f = fopen(fname, "w");
+	if (f == NULL) {
+		return -1;
+	}
+	fprintf(f, "// generated by keymapc from %s, do not edit\n", keymap_fname);
+	fprintf(f, "// sorted by IR code and not null terminated, %d pairs\n", entry_cnt);
+	fprintf(f, "#define %s {\t\\\n", name);
+	for (int i = 0; i < entry_cnt; i++) {
+		fprintf(f, "0x%08X, 0x%08X,\t\\\n", entries[i].ir, entries[i].kc);
+	}
+	fprintf(f, "}\n");
+	*size = entry_cnt * 8;
+	return fclose(f);
+}
+
+// a feature report ioctl that tries again while the device is busy writing flash (the transfer times out or stalls)
+// a SET_REPORT that arrives while the last command is still being carried out is not refused,
+// V-USB accepts the data and the firmware drops it, so vcfg_cmd checks that the answer is for its command
+static int vcfg_ioctl(int fd, unsigned long req, uint8_t* buf)
+{
+	for (int tries = 0; tries < VCFG_RETRIES; tries++)
+	{
+		if (ioctl(fd, req, buf) >= 0) {
+			return 0;
+		}
+		if (errno != EPIPE && errno != ETIMEDOUT) {
+			return -1;
+		}
+		usleep(FLASH_STALL_US);
+	}
+	return -1;
+}
+
+// sends one command and waits for it to be carried out, returns the status and leaves the result in buf
+// stall is the number of flash erases or writes the command makes, the device is not asked for the result before they are surely done
+// the device echoes the command and argument, and leaves data it does not return alone,
+// an answer that does not match was left by an earlier command and this one was dropped
+static int vcfg_cmd(int fd, uint8_t cmd, uint8_t arg, const uint8_t* data, int len, uint8_t* buf, int stall)
+{
+	memset(buf, 0, VCFG_REPORT_LEN);
+	buf[0] = VCFG_REPORT_ID;
+	buf[1] = cmd;
+	buf[2] = arg;
+	if (data != NULL) memcpy(&buf[4], data, len);
+	if (vcfg_ioctl(fd, HIDIOCSFEATURE(VCFG_REPORT_LEN), buf) < 0) {
+		return -1;
+	}
+	if (stall) {
+		usleep(stall * FLASH_STALL_US);
+	}
+	for (int tries = 0; tries < 100; tries++)
+	{
+		buf[0] = VCFG_REPORT_ID;
+		if (vcfg_ioctl(fd, HIDIOCGFEATURE(VCFG_REPORT_LEN), buf) < 0) {
+			return -1;
+		}
+		if (buf[3] != VCFG_BUSY)
+		{
+			if (buf[1] != cmd || buf[2] != arg || (data != NULL && memcmp(&buf[4], data, len) != 0)) {
+				fprintf(stderr, "the device answered for another command, was something else using it?\n");
+				return -1;
+			}
+			return buf[3];
+		}
+		usleep(2000);
+	}
+	return -1;
+}
+
+// replaces the learned keymap (or the flash keymap) of the device with the entries
+static int upload(const char* dev, int flash)
+{
+	uint8_t buf[VCFG_REPORT_LEN];
+	int fd = open(dev, O_RDWR);
+	if (fd < 0) {
+		perror(dev);
+		return -1;
+	}
+	if (vcfg_cmd(fd, VCFG_INFO, 0, NULL, 0, buf, 0) != VCFG_OK) {
+		fprintf(stderr, "%s: no answer, is the firmware built with ENABLE_VENDOR_CONFIG?\n", dev);
+		close(fd);
+		return -1;
+	}
+	if (buf[4] != KEYMAP_VERSION || (!flash && entry_cnt > buf[5])) {
+		fprintf(stderr, "%s: keymap version %d with %d records does not fit\n", dev, buf[4], buf[5]);
+		close(fd);
+		return -1;
+	}
+	// the entries are sorted, which the flash keymap needs
+	int r = vcfg_cmd(fd, flash ? VCFG_FLASH_BEGIN : VCFG_REC_CLEAR, 0, NULL, 0, buf, flash);
+	for (int i = 0; i < entry_cnt && r == VCFG_OK; i++)
+	{
+		uint8_t rec[KEYMAP_REC_SIZE];
+		put_le(&rec[0], entries[i].ir, 4);
+		put_le(&rec[4], entries[i].kc, 4);
+		// the first record of a page makes the device erase it, the record that fills it makes the device write it
+		int stall = flash && (i % FLASHMAP_PAGE_RECS == 0 || (i + 1) % FLASHMAP_PAGE_RECS == 0);
+		r = vcfg_cmd(fd, flash ? VCFG_FLASH_ADD : VCFG_REC_SET, 0, rec, sizeof(rec), buf, stall);
+	}
+	if (r == VCFG_OK) {
+		// the commit writes the last partial page and the header page
+		r = vcfg_cmd(fd, flash ? VCFG_FLASH_COMMIT : VCFG_REC_COMMIT, 0, NULL, 0, buf, flash ? 2 : 0);
+	}
+	close(fd);
+	if (r != VCFG_OK && flash) {
+		fprintf(stderr, "%s: upload failed with status %d, the flash keymap is empty now\n", dev, r);
+		return -1;
+	}
+	if (r != VCFG_OK) {
+		// the records are written in place, there is no room in EEPROM for a second copy
+		fprintf(stderr, "%s: upload failed with status %d, the learned keymap is incomplete and must be uploaded again\n", dev, r);
+		return -1;
+	}
+	return 0;
+}
+
+static int ends_with(const char* s, const char* suffix)
+{
+	size_t a = strlen(s), b = strlen(suffix);
+	return a >= b && strcmp(s + a - b, suffix) == 0;
+}
+
+int main(int argc, char** argv)
+{
+	const char* dir = ".";
+	const char* out = NULL;
+	const char* name = "USR_KEYMAP_PAIRS";
+	const char* dev = NULL;
+	int flash = 0;
+
+	int i;
+	for (i = 1; i < argc - 1 && argv[i][0] == '-'; i++)
+	{
+		if (strcmp(argv[i], "-F") == 0) flash = 1;
+		else if (i == argc - 2) break; // the rest need a value
+		else if (strcmp(argv[i], "-I") == 0) dir = argv[++i];
+		else if (strcmp(argv[i], "-o") == 0) out = argv[++i];
+		else if (strcmp(argv[i], "-n") == 0) name = argv[++i];
+		else if (strcmp(argv[i], "-u") == 0) dev = argv[++i];
+		else break;
+	}
+	if (i != argc - 1 || (flash && dev == NULL)) {
+		fprintf(stderr, "usage: %s [-I dir] [-o out.eep | -o out.h] [-n NAME] [-u /dev/hidrawN [-F]] keymap.txt\n", argv[0]);
+		return 2;
+	}
+	keymap_fname = argv[i];
+
+	static const char* headers[] = { "kbrd_codes.h", "xbmc_keys.h", "nec_defaults.h", "main.h" };
+	for (int h = 0; h < (int)(sizeof(headers) / sizeof(headers[0])); h++)
+	{
+		if (sym_load(dir, headers[h]) != 0) {
+			fprintf(stderr, "cannot read %s/%s, use -I to point at the firmware source\n", dir, headers[h]);
+			return 2;
+		}
+	}
+
+	FILE* f = fopen(keymap_fname, "r");
+	if (f == NULL) {
+		perror(keymap_fname);
+		return 2;
+	}
+	char line[MAX_LINE];
+	for (int ln = 1; fgets(line, sizeof(line), f) != NULL; ln++) {
+		keymap_parse_line(line, ln);
+	}
+	fclose(f);
+
+	qsort(entries, entry_cnt, sizeof(entry_t), entry_cmp);
+
+	int max = keymap_max_records();
+	int to_header = out != NULL && ends_with(out, ".h");
+	if (((out != NULL && !to_header) || (dev != NULL && !flash) || (out == NULL && dev == NULL)) && entry_cnt > max)
+	{
+		fprintf(stderr, "%s: %d entries do not fit, the EEPROM keymap holds %d\n", keymap_fname, entry_cnt, max);
+		errors++;
+	}
+	if (flash && entry_cnt > FLASHMAP_MAX_RECORDS)
+	{
+		fprintf(stderr, "%s: %d entries do not fit, the flash keymap holds %d\n", keymap_fname, entry_cnt, FLASHMAP_MAX_RECORDS);
+		errors++;
+	}
+	if (errors != 0) {
+		fprintf(stderr, "%d error(s), nothing written\n", errors);
+		return 1;
+	}
+
+	int size = 0;
+	if (out != NULL)
+	{
+		int r = to_header ? write_header(out, name, &size) : write_eep(out, &size);
+		if (r != 0) {
+			perror(out);
+			return 1;
+		}
+	}
+
+	if (dev != NULL && upload(dev, flash) != 0) {
+		return 1;
+	}
+
+	printf("%d entries, %d remote(s)%s\n", entry_cnt, remote_cnt, dev != NULL ? ", uploaded" : "");
+	if (to_header) {
+		printf("flash: %d bytes of PROGMEM\n", size);
+	}
+	else if (flash) {
+		printf("flash keymap: %d of %d records\n", entry_cnt, FLASHMAP_MAX_RECORDS);
+	}
+	else {
+		printf("EEPROM: %d of %d bytes (%d of %d records)\n", KEYMAP_HDR_SIZE + entry_cnt * KEYMAP_REC_SIZE, KEYMAP_HDR_SIZE + max * KEYMAP_REC_SIZE, entry_cnt, max);
+	}
+	return 0;
+}
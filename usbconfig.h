@@ -94,7 +94,11 @@ section at the end of this file).
  * default control endpoint 0 and an interrupt-in endpoint (any other endpoint
  * number).
 */
+#ifdef ENABLE_SECOND_ENDPOINT
+#define USB_CFG_HAVE_INTRIN_ENDPOINT3   1 // CHANGED, consumer, system, mouse and vendor reports get their own interface, see main.c
+#else
 #define USB_CFG_HAVE_INTRIN_ENDPOINT3   0
+#endif
 /* Define this to 1 if you want to compile a version with three endpoints: The
  * default control endpoint 0, an interrupt-in endpoint 3 (or the number
  * configured below) and a catch-all default interrupt-in endpoint as above.
@@ -307,27 +311,39 @@ extern void usbEventResetReady(void);
  * CDC class is 2, use subclass 2 and protocol 1 for ACM
 */
 
+// every optional report adds its part of the descriptor, see usbHidReportDescriptor in main.c
 #define HID_RPT_DESC_LEN_KEYBOARD 67
+#ifdef ENABLE_CONSUMER
 #define HID_RPT_DESC_LEN_CONSUMER 25
+#else
+#define HID_RPT_DESC_LEN_CONSUMER 0
+#endif
+#ifdef ENABLE_SYS_CONTROL
 #define HID_RPT_DESC_LEN_SYSCTRL  29
+#else
+#define HID_RPT_DESC_LEN_SYSCTRL  0
+#endif
+#ifdef ENABLE_MOUSE
 #define HID_RPT_DESC_LEN_MOUSE    52
-
-#if defined(ENABLE_SYS_CONTROL) && defined(ENABLE_CONSUMER) && defined(ENABLE_MOUSE)
-#define USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH    (HID_RPT_DESC_LEN_KEYBOARD + HID_RPT_DESC_LEN_CONSUMER + HID_RPT_DESC_LEN_SYSCTRL + HID_RPT_DESC_LEN_MOUSE)
-#elif defined(ENABLE_CONSUMER) && defined(ENABLE_MOUSE)
-#define USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH    (HID_RPT_DESC_LEN_KEYBOARD + HID_RPT_DESC_LEN_CONSUMER + HID_RPT_DESC_LEN_MOUSE)
-#elif defined(ENABLE_SYS_CONTROL) && defined(ENABLE_MOUSE)
-#define USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH    (HID_RPT_DESC_LEN_KEYBOARD + HID_RPT_DESC_LEN_SYSCTRL + HID_RPT_DESC_LEN_MOUSE)
-#elif defined(ENABLE_SYS_CONTROL) && defined(ENABLE_CONSUMER)
-#define USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH    (HID_RPT_DESC_LEN_KEYBOARD + HID_RPT_DESC_LEN_CONSUMER + HID_RPT_DESC_LEN_SYSCTRL)
-#elif defined(ENABLE_CONSUMER)
-#define USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH    (HID_RPT_DESC_LEN_KEYBOARD + HID_RPT_DESC_LEN_CONSUMER)
-#elif defined(ENABLE_SYS_CONTROL)
-#define USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH    (HID_RPT_DESC_LEN_KEYBOARD + HID_RPT_DESC_LEN_SYSCTRL)
-#elif defined(ENABLE_MOUSE)
-#define USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH    (HID_RPT_DESC_LEN_KEYBOARD + HID_RPT_DESC_LEN_MOUSE)
 #else
-#define USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH    (HID_RPT_DESC_LEN_KEYBOARD)
+#define HID_RPT_DESC_LEN_MOUSE    0
+#endif
+#ifdef ENABLE_VENDOR_CONFIG
+#define HID_RPT_DESC_LEN_VENDOR   23
+#else
+#define HID_RPT_DESC_LEN_VENDOR   0
+#endif
+
+#define USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH    (HID_RPT_DESC_LEN_KEYBOARD + HID_RPT_DESC_LEN_CONSUMER + HID_RPT_DESC_LEN_SYSCTRL + HID_RPT_DESC_LEN_MOUSE + HID_RPT_DESC_LEN_VENDOR)
+
+#ifdef ENABLE_SECOND_ENDPOINT
+// the keyboard part of the report descriptor belongs to the first interface, the rest to the second
+#define HID_RPT_DESC_LEN_SECOND (USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH - HID_RPT_DESC_LEN_KEYBOARD)
+#if HID_RPT_DESC_LEN_SECOND == 0
+#error "ENABLE_SECOND_ENDPOINT needs at least one of the consumer, system, mouse or vendor reports"
+#endif
+// configuration, then interface, HID and endpoint descriptors for each of the two interfaces
+#define USB_CFG_CONFIGURATION_LENGTH (9 + (9 + 9 + 7) * 2)
 #endif
 
 
@@ -396,14 +412,23 @@ extern void usbEventResetReady(void);
 */
 
 #define USB_CFG_DESCR_PROPS_DEVICE                  0
+#ifdef ENABLE_SECOND_ENDPOINT
+#define USB_CFG_DESCR_PROPS_CONFIGURATION           USB_PROP_LENGTH(USB_CFG_CONFIGURATION_LENGTH) // CHANGED, see usbDescriptorConfiguration in main.c
+#else
 #define USB_CFG_DESCR_PROPS_CONFIGURATION           0
+#endif
 #define USB_CFG_DESCR_PROPS_STRINGS                 0
 #define USB_CFG_DESCR_PROPS_STRING_0                0
 #define USB_CFG_DESCR_PROPS_STRING_VENDOR           0
 #define USB_CFG_DESCR_PROPS_STRING_PRODUCT          0
 #define USB_CFG_DESCR_PROPS_STRING_SERIAL_NUMBER    0
+#ifdef ENABLE_SECOND_ENDPOINT
+#define USB_CFG_DESCR_PROPS_HID                     USB_PROP_IS_DYNAMIC // CHANGED, depends on the interface, see usbFunctionDescriptor in main.c
+#define USB_CFG_DESCR_PROPS_HID_REPORT              USB_PROP_IS_DYNAMIC
+#else
 #define USB_CFG_DESCR_PROPS_HID                     0
 #define USB_CFG_DESCR_PROPS_HID_REPORT              0
+#endif
 #define USB_CFG_DESCR_PROPS_UNKNOWN                 0
 
 /* ----------------------- Optional MCU Description ------------------------ */
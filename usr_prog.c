@@ -1,7 +1,9 @@
 #include "main.h"
 #include <avr/pgmspace.h>
 #include <avr/eeprom.h>
+#include <util/crc16.h>
 #include <stdio.h>
+#include <util/delay.h>
 
 // sorry, i can only place string tables in flash by declaring them seperately
 const PROGMEM char descstr_menu[]			 = "escape";
@@ -11,6 +13,9 @@ const PROGMEM char descstr_volup[]			 = "up arrow";
 const PROGMEM char descstr_voldn[]			 = "down arrow";
 const PROGMEM char descstr_next[]			 = "right arrow";
 const PROGMEM char descstr_prev[]			 = "left arrow";
+#ifdef ENABLE_MOUSE
+const PROGMEM char descstr_pointer[]		 = "pointer mode";
+#endif
 /*
 const PROGMEM char descstr_stop[]			 = "stop";
 const PROGMEM char descstr_mute[]			 = "mute";
@@ -29,7 +34,7 @@ const PROGMEM char descstr_fav[]			 = "favorite";
 
 #include "kbrd_codes.h"
 // pair up the action and the description here
-const PROGMEM code_desc_t code_desc_tbl[] = { // remember to change the count!
+const PROGMEM code_desc_t code_desc_tbl[] = { // remember to change the count! (CODE_DESC_CNT in main.h)
 	{ .c = KEYCODE_ARROW_UP ,			.s = descstr_volup },
 	{ .c = KEYCODE_ARROW_DOWN ,		.s = descstr_voldn },
 	{ .c = KEYCODE_ARROW_RIGHT ,	.s = descstr_next },
@@ -37,6 +42,9 @@ const PROGMEM code_desc_t code_desc_tbl[] = { // remember to change the count!
 	{ .c = KEYCODE_SPACE ,		.s = descstr_playpause },
 	{ .c = KEYCODE_ENTER ,			.s = descstr_select },
 	{ .c = KEYCODE_ESC ,			.s = descstr_menu },
+	#ifdef ENABLE_MOUSE
+	{ .c = KEYCODE_FN_POINTER ,		.s = descstr_pointer }, // so the default build can reach pointer mode, skip it to leave it unbound
+	#endif
 	/*
 	{ .c = KEYCODE_STOP ,			.s = descstr_stop },
 	{ .c = KEYCODE_SYS_SLEEP ,		.s = descstr_power },
@@ -55,8 +63,6 @@ const PROGMEM code_desc_t code_desc_tbl[] = { // remember to change the count!
 	{ .c = 0 , .s = 0 }, // null terminated to signal end of table
 };
 
-static char desc_buff[32];
-
 void usr_prog()
 {
 	printf_P(PSTR("\nWelcome to IR Keyboard Programming Mode\n"));
@@ -69,12 +75,9 @@ void usr_prog()
 			// null termination found or flash memory empty
 			break;
 		}
-		strcpy_PF((void*)desc_buff, (uint_farptr_t)cd.s);
-		printf_P(PSTR("Press \"%s\""), desc_buff); // prompt the user
+		printf_P(PSTR("Press \"%S\""), cd.s); // prompt the user, %S reads the string straight from flash
 		static uint32_t ir_code;
-		TCNT1 = 0;
-		if (bit_is_set(TIFR, TOV1)) TIFR |= _BV(TOV1);
-		uint8_t tmr1_ovf_cnt = 0;
+		uint16_t t = ms_get();
 		while (1)
 		{
 			usbPollWrapper();
@@ -82,16 +85,13 @@ void usr_prog()
 			ircap_res_t r = ir_cap(&ir_code);
 
 			if (r != IRCAP_NOTHING) {
-				tmr1_ovf_cnt = 0;
-			}
-
-			if (bit_is_set(TIFR, TOV1)) {
-				TIFR |= _BV(TOV1);
-				tmr1_ovf_cnt++;
+				t = ms_get();
 			}
 
 			if (r == IRCAP_NEWKEY) {
-				eeprom_update_dword((uint32_t*)(i * sizeof(uint32_t)), ir_code);
+				// the new code replaces whatever used to trigger this key
+				usr_keymap_remove_kc(cd.c);
+				usr_keymap_set(ir_code, cd.c);
 				#ifdef ENABLE_PROG_DEBUG
 				printf_P(PSTR(" [Read 0x%04X%04X]"),
 					(unsigned int)((ir_code & 0xFFFF0000) >> 16), 
@@ -102,36 +102,354 @@ void usr_prog()
 				printf_P(PSTR(" OK!\n"));
 				break;
 			}
-			else if (tmr1_ovf_cnt >= TMR1_TIMEOUT_5S) { // took too long
-				uint32_t ic = eeprom_read_dword((uint32_t*)(i * sizeof(uint32_t)));
-				if (ic == 0 && ic == 0xFFFFFFFF) {
-					eeprom_update_dword((uint32_t*)(i * sizeof(uint32_t)), 0x01); // insert empty placeholder that is neither null nor empty
-				}
+			else if ((uint16_t)(ms_get() - t) >= PROG_TIMEOUT_MS) { // took too long, keep the old code
 				printf_P(PSTR(", nevermind\n"));
 				break;
 			}
 		}
 	}
 
+	usr_keymap_commit();
+	eeq_flush(); // so all done really means it is safe to unplug
+
 	printf_P(PSTR("All Done!\n"));
 }
 
-uint32_t usr_ir_to_kb(uint32_t ir)
+#ifdef ENABLE_FAST_LEARN
+// learning without typing anything, only the LED shows what is going on
+// the buttons are learned in the order of code_desc_tbl, the LED is on while waiting for one
+// every button must be pressed FAST_LEARN_CAPTURES times with the same code, the LED flickers on each press
+// a double blink means the button was learned, a long off means the code was rejected (noise or already used)
+// pressing the hardware button skips a button and keeps its old code
+// nothing is written to EEPROM until every button is done, and nothing at all if the user walks away
+
+#define FAST_LEARN_CAPTURES	3
+#define FAST_LEARN_IDLE_MS	(PROG_TIMEOUT_MS * 6) // give up after 30 seconds without input
+
+// sets the LED and waits while servicing USB
+static void usr_led_wait(char on, uint8_t ms)
 {
-	for (int i = 0; ; i++)
-	{
+	if (on) {
+		LED_PORTx |=  LED_PINMASK;
+	}
+	else {
+		LED_PORTx &= ~LED_PINMASK;
+	}
+	while (ms--) {
 		usbPollWrapper();
-		uint32_t ic = eeprom_read_dword((uint32_t*)(i * sizeof(uint32_t)));
-		if (ic == 0 || ic == 0xFFFFFFFF) {
+		_delay_ms(1);
+	}
+}
+
+void usr_prog_fast()
+{
+	uint32_t* codes = fast_learn_codes; // not on the stack, usbPollWrapper and the interrupts need it
+	uint16_t t = ms_get(); // last input
+
+	for (uint8_t i = 0; i < CODE_DESC_CNT; i++)
+	{
+		uint32_t ir_code, cand = 0;
+		uint8_t n = 0; // consistent captures of cand so far
+
+		LED_PORTx |= LED_PINMASK; // LED on, waiting
+		while (1)
+		{
+			usbPollWrapper();
+
+			ircap_res_t r = ir_cap(&ir_code);
+
+			if (r != IRCAP_NOTHING) {
+				t = ms_get();
+			}
+
+			if ((uint16_t)(ms_get() - t) >= FAST_LEARN_IDLE_MS) {
+				LED_PORTx &= ~LED_PINMASK; // LED off
+				return; // abandoned, keep the old codes
+			}
+
+			if (bit_is_clear(JMP_PINx, JMP_PINNUM))
+			{
+				// skip this one
+				while (bit_is_clear(JMP_PINx, JMP_PINNUM)) usbPollWrapper(); // wait for release
+				usr_led_wait(0, 20); // debounce
+				t = ms_get();
+				codes[i] = 0;
+				break;
+			}
+
+			if (r == IRCAP_NEWKEY)
+			{
+				if (n != 0 && ir_code != cand) {
+					n = 0; // not the same as before, start over with this one
+				}
+				cand = ir_code;
+				n++;
+
+				if (n < FAST_LEARN_CAPTURES) {
+					usr_led_wait(0, 50); // flicker to acknowledge the press
+					LED_PORTx |= LED_PINMASK;
+					continue;
+				}
+
+				uint8_t j;
+				for (j = 0; j < i && codes[j] != cand; j++);
+				if (j == i) {
+					codes[i] = cand;
+					break;
+				}
+
+				// already used for another action, half a second off
+				n = 0;
+				usr_led_wait(0, 250);
+				usr_led_wait(0, 250);
+				LED_PORTx |= LED_PINMASK;
+			}
+		}
+
+		// double blink for done
+		usr_led_wait(0, 100);
+		usr_led_wait(1, 100);
+		usr_led_wait(0, 100);
+		usr_led_wait(1, 100);
+		usr_led_wait(0, 100);
+	}
+
+	// all in one go at the end
+	for (uint8_t i = 0; i < CODE_DESC_CNT; i++)
+	{
+		if (codes[i] != 0)
+		{
+			uint32_t kc = pgm_read_dword(&code_desc_tbl[i].c);
+			usr_keymap_remove_kc(kc);
+			usr_keymap_set(codes[i], kc);
+		}
+	}
+	usr_keymap_commit();
+	eeq_flush(); // the LED only goes off once it is safe to unplug
+	LED_PORTx &= ~LED_PINMASK; // LED off
+}
+#endif
+
+// the learned codes are stored in EEPROM as a header followed by (IR code, keycode) records, see keymap_hdr_t
+// the header holds the number of records and a CRC of them, a table that fails the check is not used
+// at start-up the table is checked in one pass and a 4 bit fingerprint of every IR code is kept in RAM
+// so a lookup only reads the records from EEPROM that can possibly match (about one in 16 of the others)
+
+#define USR_REC_EEADDR(i) ((void*)(KEYMAP_EEADDR + sizeof(keymap_hdr_t) + (i) * sizeof(keymap_rec_t)))
+
+static uint8_t usr_rec_cnt = 0; // number of valid records
+static uint8_t usr_keymap_state = KEYMAP_BLANK; // what usr_keymap_init found, see KEYMAP_OK
+static uint8_t usr_rec_fp[(KEYMAP_MAX_RECORDS + 1) / 2]; // fingerprint of each record's IR code, two to a byte
+
+// the command byte (bits 16-23) is what differs between the buttons of one remote, so it makes a good fingerprint
+// both halves are folded into 4 bits so the fingerprints take half the RAM
+#define IR_CODE_FP(x) ((uint8_t)(((x) >> 16) ^ ((x) >> 20)) & 0x0F)
+
+static uint8_t usr_fp_get(uint8_t i)
+{
+	uint8_t b = usr_rec_fp[i >> 1];
+	return (i & 1) ? (b >> 4) : (b & 0x0F);
+}
+
+static void usr_fp_set(uint8_t i, uint32_t ir)
+{
+	uint8_t* b = &usr_rec_fp[i >> 1];
+	if (i & 1) {
+		*b = (*b & 0x0F) | (IR_CODE_FP(ir) << 4);
+	}
+	else {
+		*b = (*b & 0xF0) | IR_CODE_FP(ir);
+	}
+}
+
+static void usr_rec_read(uint8_t i, keymap_rec_t* rec)
+{
+	eeq_read_block((void*)rec, USR_REC_EEADDR(i), sizeof(keymap_rec_t));
+}
+
+static void usr_rec_write(uint8_t i, keymap_rec_t* rec)
+{
+	eeq_write_block((void*)rec, USR_REC_EEADDR(i), sizeof(keymap_rec_t));
+	usr_fp_set(i, rec->ir);
+}
+
+// CRC of the first cnt records as they are in EEPROM, also refreshes the fingerprints
+static uint16_t usr_rec_crc(uint8_t cnt)
+{
+	uint16_t crc = 0xFFFF;
+	for (uint8_t i = 0; i < cnt; i++)
+	{
+		keymap_rec_t rec;
+		usr_rec_read(i, &rec);
+		usr_fp_set(i, rec.ir);
+		for (uint8_t j = 0; j < sizeof(keymap_rec_t); j++) {
+			crc = _crc16_update(crc, ((uint8_t*)&rec)[j]);
+		}
+	}
+	return crc;
+}
+
+// the first version of the table was just IR codes stored in the order of code_desc_tbl
+// convert it so units that already learned a remote keep working
+// returns the number of codes found, 0 if there was no table
+#define CODE_DESC_V1_CNT 7 // code_desc_tbl had 7 entries then, and the table was not terminated when all of them were learned
+static uint8_t usr_keymap_convert_v1()
+{
+	uint32_t codes[CODE_DESC_V1_CNT];
+	uint8_t n;
+	for (n = 0; n < sizeof(codes) / sizeof(uint32_t); n++)
+	{
+		codes[n] = eeprom_read_dword((uint32_t*)(n * sizeof(uint32_t)));
+		if (codes[n] == 0 || codes[n] == 0xFFFFFFFF) {
 			// null termination found or empty
 			break;
 		}
-		if (ic == ir) {
-			code_desc_t cd;
-			memcpy_PF((void*)&cd, (uint_farptr_t)&(code_desc_tbl[i]), sizeof(code_desc_t));
-			return cd.c;
+	}
+	for (uint8_t i = 0; i < n; i++)
+	{
+		if (codes[i] != 0x01) { // placeholder for a skipped code
+			usr_keymap_set(codes[i], pgm_read_dword(&code_desc_tbl[i].c));
+		}
+	}
+	if (n != 0) {
+		usr_keymap_commit();
+	}
+	return n;
+}
+
+// checks and loads the learned code table, must be called once at start-up
+// a table that fails the check is not used at all, so lookups only ever go through records that passed
+// the defaults in flash keep working and the fault is returned (and kept for usr_keymap_status)
+uint8_t usr_keymap_init()
+{
+	keymap_hdr_t hdr;
+	eeprom_read_block((void*)&hdr, (void*)KEYMAP_EEADDR, sizeof(keymap_hdr_t));
+	usr_rec_cnt = 0;
+	usr_keymap_state = KEYMAP_CORRUPT;
+	if (hdr.magic != KEYMAP_MAGIC)
+	{
+		usr_keymap_state = usr_keymap_convert_v1() != 0 ? KEYMAP_OK : KEYMAP_BLANK;
+	}
+	else if (hdr.version == KEYMAP_VERSION && hdr.count <= KEYMAP_MAX_RECORDS && usr_rec_crc(hdr.count) == hdr.crc)
+	{
+		usr_rec_cnt = hdr.count;
+		usr_keymap_state = KEYMAP_OK;
+	}
+	return usr_keymap_state;
+}
+
+uint8_t usr_keymap_status()
+{
+	return usr_keymap_state;
+}
+
+// removes every record that maps to a keycode
+void usr_keymap_remove_kc(uint32_t kc)
+{
+	for (uint8_t i = 0; i < usr_rec_cnt; )
+	{
+		keymap_rec_t rec;
+		usr_rec_read(i, &rec);
+		if (rec.kc == kc)
+		{
+			// fill the hole with the last record, order does not matter
+			usr_rec_cnt--;
+			if (i != usr_rec_cnt) {
+				usr_rec_read(usr_rec_cnt, &rec);
+				usr_rec_write(i, &rec);
+			}
+		}
+		else
+		{
+			i++;
+		}
+	}
+}
+
+// maps an IR code to a keycode, replacing the existing record for the IR code if there is one
+// returns 0 if the table is full
+// nothing is final until usr_keymap_commit is called
+uint8_t usr_keymap_set(uint32_t ir, uint32_t kc)
+{
+	keymap_rec_t rec;
+	uint8_t i;
+	for (i = 0; i < usr_rec_cnt; i++)
+	{
+		if (usr_fp_get(i) == IR_CODE_FP(ir))
+		{
+			usr_rec_read(i, &rec);
+			if (rec.ir == ir) {
+				break;
+			}
+		}
+	}
+	if (i == KEYMAP_MAX_RECORDS) {
+		return 0;
+	}
+	rec.ir = ir;
+	rec.kc = kc;
+	usr_rec_write(i, &rec);
+	if (i == usr_rec_cnt) {
+		usr_rec_cnt++;
+	}
+	return 1;
+}
+
+// writes the header that makes the records written so far valid
+void usr_keymap_commit()
+{
+	keymap_hdr_t hdr;
+	hdr.magic = KEYMAP_MAGIC;
+	hdr.version = KEYMAP_VERSION;
+	hdr.count = usr_rec_cnt;
+	hdr.crc = usr_rec_crc(usr_rec_cnt);
+	eeq_write_block((void*)&hdr, (void*)KEYMAP_EEADDR, sizeof(keymap_hdr_t)); // queued after the records, so written after them
+	usr_keymap_state = KEYMAP_OK;
+}
+
+uint8_t usr_keymap_count()
+{
+	return usr_rec_cnt;
+}
+
+void usr_keymap_read(uint8_t i, keymap_rec_t* rec)
+{
+	usr_rec_read(i, rec);
+}
+
+// forgets every record, nothing is final until usr_keymap_commit is called
+void usr_keymap_clear()
+{
+	usr_rec_cnt = 0;
+}
+
+uint32_t usr_ir_to_kb(uint32_t ir)
+{
+	uint8_t fp = IR_CODE_FP(ir);
+	for (uint8_t i = 0; i < usr_rec_cnt; i++)
+	{
+		if (usr_fp_get(i) == fp)
+		{
+			keymap_rec_t rec;
+			usr_rec_read(i, &rec);
+			if (rec.ir == ir) {
+				return rec.kc;
+			}
 		}
 	}
 
 	return 0;
 }
+
+#ifdef ENABLE_ADDR_FILTER
+// allows the address of every learned code through the address filter
+void usr_addr_filter_add()
+{
+	for (uint8_t i = 0; i < usr_rec_cnt; i++)
+	{
+		uint16_t addr;
+		eeq_read_block((void*)&addr, USR_REC_EEADDR(i), sizeof(uint16_t));
+		addr_filter_add(addr, 0xFFFF);
+	}
+}
+#endif
@@ -0,0 +1,163 @@
+#include "main.h"
+#include <string.h>
+
+// configuration over USB, without the typed out menu of usr_prog
+// the host sends a command with SET_REPORT (feature, VCFG_REPORT_ID) and reads the result back with GET_REPORT
+// the command is only copied in by usbFunctionWrite, it is carried out later by vcfg_task in the main loop
+// so EEPROM writes never happen inside a USB transfer, the status byte reads VCFG_BUSY until it is done
+//
+// report layout (after the report ID): command, argument, status, VCFG_DATA_LEN bytes of data
+// the result is written over the data that came with the command, bytes a command does not return are left as they were
+// all multi-byte values are little endian, a keymap record is sent as it is stored (see keymap_rec_t)
+//
+// to replace the whole learned keymap: VCFG_REC_CLEAR, one VCFG_REC_SET per record, then VCFG_REC_COMMIT
+// the records are written over the old ones right away (the EEPROM has no room for a second table)
+// so if the upload stops before the commit, the old keymap is gone and fails its check at the next start-up
+
+#ifdef ENABLE_VENDOR_CONFIG
+
+ir_stats_t ir_stats;
+
+static uint8_t vcfg_buf[VCFG_REPORT_LEN]; // report ID, command, argument, status, data
+static uint8_t vcfg_idx; // bytes received so far by usbFunctionWrite
+static volatile char vcfg_pending = 0; // a command was received and not carried out yet
+
+#define VCFG_CMD	vcfg_buf[1]
+#define VCFG_ARG	vcfg_buf[2]
+#define VCFG_STATUS	vcfg_buf[3]
+#define VCFG_DATA	(&vcfg_buf[4])
+
+// called from usbFunctionSetup for a GET_REPORT of the vendor report
+uint8_t* vcfg_report()
+{
+	vcfg_buf[0] = VCFG_REPORT_ID;
+	return vcfg_buf;
+}
+
+// called from usbFunctionSetup for a SET_REPORT of the vendor report
+// returns 0 if a command is still being carried out, the new one is then dropped
+// (the host cannot be told, V-USB acknowledges the data anyway, but GET_REPORT still echoes the old command)
+char vcfg_write_start()
+{
+	if (vcfg_pending) {
+		return 0;
+	}
+	vcfg_idx = 0;
+	return 1;
+}
+
+// called from usbFunctionWrite with every chunk of the report, returns 1 when the whole report is in
+uint8_t vcfg_write(uint8_t* data, uint8_t len)
+{
+	for (uint8_t i = 0; i < len && vcfg_idx < VCFG_REPORT_LEN; i++) {
+		vcfg_buf[vcfg_idx++] = data[i];
+	}
+	if (vcfg_idx < VCFG_REPORT_LEN) {
+		return 0;
+	}
+	VCFG_STATUS = VCFG_BUSY;
+	vcfg_pending = 1;
+	return 1;
+}
+
+static uint8_t vcfg_exec()
+{
+	keymap_rec_t rec;
+	uint8_t status;
+	(void)status; // when nothing uses it
+
+	switch (VCFG_CMD)
+	{
+		case VCFG_INFO:
+			VCFG_DATA[0] = KEYMAP_VERSION;
+			VCFG_DATA[1] = KEYMAP_MAX_RECORDS;
+			VCFG_DATA[2] = usr_keymap_count();
+			VCFG_DATA[3] = mmkey_get();
+			VCFG_DATA[4] = keymap_profile_get();
+			VCFG_DATA[5] = usr_keymap_status();
+			#ifdef ENABLE_FLASH_KEYMAP
+			VCFG_DATA[6] = flashmap_count();
+			#else
+			VCFG_DATA[6] = 0;
+			#endif
+			VCFG_DATA[7] = layout_get();
+			return VCFG_OK;
+		case VCFG_REC_READ:
+			if (VCFG_ARG >= usr_keymap_count()) {
+				return VCFG_ERR_ARG;
+			}
+			usr_keymap_read(VCFG_ARG, &rec);
+			memcpy(VCFG_DATA, &rec, sizeof(keymap_rec_t));
+			return VCFG_OK;
+		case VCFG_REC_CLEAR:
+			usr_keymap_clear();
+			return VCFG_OK;
+		case VCFG_REC_SET:
+			memcpy(&rec, VCFG_DATA, sizeof(keymap_rec_t));
+			if (rec.ir == 0 || rec.kc == 0) {
+				return VCFG_ERR_ARG;
+			}
+			return usr_keymap_set(rec.ir, rec.kc) ? VCFG_OK : VCFG_ERR_FULL;
+		case VCFG_REC_COMMIT:
+			usr_keymap_commit();
+			#ifdef ENABLE_ADDR_FILTER
+			addr_filter_init(); // the new keymap may have codes from other remotes
+			#endif
+			return VCFG_OK;
+		case VCFG_MODE_SET:
+			mmkey_set(VCFG_ARG);
+			VCFG_DATA[0] = mmkey_get();
+			return VCFG_OK;
+		case VCFG_PROFILE_SET:
+			#ifdef ENABLE_PROFILES
+			keymap_fn(KEYCODE_FN_PROFILE(VCFG_ARG));
+			VCFG_DATA[0] = keymap_profile_get();
+			return VCFG_OK;
+			#else
+			return VCFG_ERR_CMD;
+			#endif
+		case VCFG_STATS:
+			memcpy(VCFG_DATA, &ir_stats, sizeof(ir_stats_t));
+			if (VCFG_ARG != 0) {
+				memset(&ir_stats, 0, sizeof(ir_stats_t)); // read and clear
+			}
+			return VCFG_OK;
+		case VCFG_LAYOUT_SET:
+			#ifdef ENABLE_LAYOUT_SELECT
+			layout_set(VCFG_ARG);
+			VCFG_DATA[0] = layout_get();
+			return VCFG_OK;
+			#else
+			return VCFG_ERR_CMD;
+			#endif
+		#ifdef ENABLE_FLASH_KEYMAP
+		case VCFG_FLASH_BEGIN:
+			flashmap_begin();
+			return VCFG_OK;
+		case VCFG_FLASH_ADD:
+			memcpy(&rec, VCFG_DATA, sizeof(keymap_rec_t));
+			return flashmap_add(&rec);
+		case VCFG_FLASH_COMMIT:
+			status = flashmap_commit();
+			#ifdef ENABLE_ADDR_FILTER
+			addr_filter_init();
+			#endif
+			return status;
+		#endif
+		default:
+			return VCFG_ERR_CMD;
+	}
+}
+
+// carries out the command the host sent, called from the main loop
+void vcfg_task()
+{
+	if (vcfg_pending == 0) {
+		return;
+	}
+	uint8_t status = vcfg_exec();
+	VCFG_STATUS = status; // only now the host can see the result
+	vcfg_pending = 0;
+}
+
+#endif